@@ -0,0 +1,163 @@
+#pragma once
+
+// a high dynamic range histogram of latencies in microseconds, good to 3 significant digits,
+// laid out like HdrHistogram so its percentile report reads the same as the .hgrm files wrk2
+// writes. Not thread safe; give each thread one and add them up at the end.
+class HdrHistogram
+{
+public:
+	// sub buckets for 3 significant digits: 2 * 10^3 rounded up to a power of two
+	static constexpr int SUB_BUCKET_HALF_COUNT_MAGNITUDE = 10;
+	static constexpr int64_t SUB_BUCKET_HALF_COUNT = 1 << SUB_BUCKET_HALF_COUNT_MAGNITUDE;
+	static constexpr int64_t SUB_BUCKET_COUNT = SUB_BUCKET_HALF_COUNT * 2;
+	static constexpr int64_t SUB_BUCKET_MASK = SUB_BUCKET_COUNT - 1;
+
+	HdrHistogram(int64_t highest = 3600ll * 1000 * 1000)
+		: _highest(highest), _bucket_count(1)
+	{
+		for (int64_t smallest_untrackable = SUB_BUCKET_COUNT; smallest_untrackable <= highest; smallest_untrackable <<= 1)
+		{
+			_bucket_count++;
+		}
+		_counts.resize((_bucket_count + 1) * SUB_BUCKET_HALF_COUNT);
+	}
+
+	void record(int64_t value)
+	{
+		value = std::max<int64_t>(0, std::min(value, _highest));
+		_counts[counts_index(value)]++;
+		_total++;
+		_max = std::max(_max, value);
+	}
+
+	void add(const HdrHistogram &other)
+	{
+		for (size_t i = 0; i < _counts.size() && i < other._counts.size(); i++) _counts[i] += other._counts[i];
+		_total += other._total;
+		_max = std::max(_max, other._max);
+	}
+
+	inline int64_t total() const { return _total; }
+	inline int64_t max() const { return _total ? highest_equivalent(_max) : 0; }
+
+	// the value at or below which the percentile of recorded values are
+	int64_t value_at(double percentile) const
+	{
+		auto wanted = std::max<int64_t>(1, static_cast<int64_t>(percentile / 100.0 * _total + 0.5));
+		int64_t seen = 0;
+		for (size_t i = 0; i < _counts.size(); i++)
+		{
+			seen += _counts[i];
+			if (seen >= wanted) return highest_equivalent(value_from_index(i));
+		}
+		return max();
+	}
+
+	double mean() const
+	{
+		if (!_total) return 0;
+		double sum = 0;
+		for (size_t i = 0; i < _counts.size(); i++)
+		{
+			if (_counts[i]) sum += static_cast<double>(median_equivalent(value_from_index(i))) * _counts[i];
+		}
+		return sum / _total;
+	}
+
+	double stddev() const
+	{
+		if (!_total) return 0;
+		auto m = mean();
+		double sum = 0;
+		for (size_t i = 0; i < _counts.size(); i++)
+		{
+			if (!_counts[i]) continue;
+			auto d = static_cast<double>(median_equivalent(value_from_index(i))) - m;
+			sum += d * d * _counts[i];
+		}
+		return sqrt(sum / _total);
+	}
+
+	// the percentile distribution, 5 lines for every halving of the distance to 100%, with values
+	// divided by scale
+	void print(FILE *f, double scale) const
+	{
+		fprintf(f, "%12s %12s %12s %12s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+
+		const int ticks_per_half_distance = 5;
+		double iterate_to = 0;
+		int64_t cumulative = 0;
+		for (size_t i = 0; i < _counts.size() && cumulative < _total; i++)
+		{
+			if (!_counts[i]) continue;
+			cumulative += _counts[i];
+
+			auto value = highest_equivalent(value_from_index(i));
+			while (iterate_to <= 100.0 * cumulative / _total)
+			{
+				auto p = iterate_to / 100.0;
+				fprintf(f, "%12.3f %12f %12lld %12.2f\n", value / scale, p, static_cast<long long>(cumulative), 1.0 / (1.0 - p));
+				// the highest value gets one line of its own, and the 100% line below
+				if (cumulative == _total) break;
+
+				auto half_distance = pow(2, static_cast<int64_t>(log(100 / (100.0 - iterate_to)) / log(2)) + 1);
+				iterate_to += 100.0 / (ticks_per_half_distance * half_distance);
+			}
+		}
+		if (_total)
+		{
+			fprintf(f, "%12.3f %12f %12lld %12.2f\n", max() / scale, 1.0, static_cast<long long>(_total), static_cast<double>(INFINITY));
+		}
+
+		fprintf(f, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean() / scale, stddev() / scale);
+		fprintf(f, "#[Max     = %12.3f, Total count    = %12lld]\n", max() / scale, static_cast<long long>(_total));
+		fprintf(f, "#[Buckets = %12d, SubBuckets     = %12d]\n", _bucket_count, static_cast<int>(SUB_BUCKET_COUNT));
+	}
+
+private:
+	static int bucket_index(int64_t value)
+	{
+		return 64 - __builtin_clzll(static_cast<uint64_t>(value) | SUB_BUCKET_MASK) - (SUB_BUCKET_HALF_COUNT_MAGNITUDE + 1);
+	}
+
+	static size_t counts_index(int64_t value)
+	{
+		auto bucket = bucket_index(value);
+		auto sub_bucket = value >> bucket;
+		return static_cast<size_t>(((bucket + 1) << SUB_BUCKET_HALF_COUNT_MAGNITUDE) + (sub_bucket - SUB_BUCKET_HALF_COUNT));
+	}
+
+	static int64_t value_from_index(size_t index)
+	{
+		int64_t bucket = static_cast<int64_t>(index >> SUB_BUCKET_HALF_COUNT_MAGNITUDE) - 1;
+		int64_t sub_bucket = static_cast<int64_t>(index & (SUB_BUCKET_HALF_COUNT - 1)) + SUB_BUCKET_HALF_COUNT;
+		if (bucket < 0)
+		{
+			sub_bucket -= SUB_BUCKET_HALF_COUNT;
+			bucket = 0;
+		}
+		return sub_bucket << bucket;
+	}
+
+	static int64_t equivalent_range(int64_t value)
+	{
+		auto bucket = bucket_index(value);
+		auto sub_bucket = value >> bucket;
+		return int64_t(1) << (sub_bucket >= SUB_BUCKET_COUNT ? bucket + 1 : bucket);
+	}
+
+	static int64_t lowest_equivalent(int64_t value)
+	{
+		auto bucket = bucket_index(value);
+		return (value >> bucket) << bucket;
+	}
+
+	static int64_t highest_equivalent(int64_t value) { return lowest_equivalent(value) + equivalent_range(value) - 1; }
+	static int64_t median_equivalent(int64_t value) { return lowest_equivalent(value) + (equivalent_range(value) >> 1); }
+
+	int64_t _highest;
+	int _bucket_count;
+	std::vector<int64_t> _counts;
+	int64_t _total = 0;
+	int64_t _max = 0;
+};
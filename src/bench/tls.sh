@@ -0,0 +1,73 @@
+#!/bin/sh
+# runs the tls handshake benchmarks against myne_server on loopback, and against nginx with the
+# same certificate if NGINX is set to its binary. Histograms go to tls-<server>-<mode>.hgrm in the
+# current directory, in the format of performance.hgrm.
+#
+#   make myne_server tlsbench && src/bench/tls.sh [connections] [seconds]
+#
+# SERVER_ARGS are passed to myne_server and default to --early-data. MODES picks the scenarios
+# out of full, resume and early.
+set -e
+
+root=$(cd "$(dirname "$0")/../.." && pwd)
+out=$(pwd)
+connections=${1:-64}
+seconds=${2:-10}
+modes=${MODES:-"full resume early"}
+
+# name port pids
+bench()
+{
+	for mode in $modes; do
+		"$root/bin/tlsbench" -m "$mode" -c "$connections" -d "$seconds" -p "$3" -o "$out/tls-$1-$mode.hgrm" "https://localhost:$2/"
+	done
+}
+
+# both servers run in a directory of their own with the certificates of the source directory and
+# a small page to serve
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cp "$root"/src/server/*.cer "$root"/src/server/*.key "$dir"
+mkdir "$dir/rabbiteer.io"
+echo "<html><body>tls benchmark</body></html>" > "$dir/rabbiteer.io/index.html"
+
+cd "$dir"
+"$root/bin/myne_server" ${SERVER_ARGS:---early-data} > "$out/tls-myne.log" 2>&1 &
+myne=$!
+sleep 1
+if ! kill -0 $myne 2>/dev/null; then
+	echo "myne_server did not start, see tls-myne.log" >&2
+	exit 1
+fi
+bench myne 8443 $myne
+kill -INT $myne
+wait $myne || true
+
+if [ -n "$NGINX" ]; then
+	cat > "$dir/nginx.conf" <<EOF
+worker_processes auto;
+pid $dir/nginx.pid;
+error_log $dir/error.log;
+events { worker_connections 4096; }
+http {
+	access_log off;
+	ssl_protocols TLSv1.2 TLSv1.3;
+	ssl_session_cache shared:SSL:20m;
+	ssl_session_tickets on;
+	ssl_early_data on;
+	server {
+		listen 8444 ssl;
+		ssl_certificate $dir/localhost.cer;
+		ssl_certificate_key $dir/localhost.key;
+		root $dir/rabbiteer.io;
+	}
+}
+EOF
+	"$NGINX" -p "$dir" -c "$dir/nginx.conf"
+	sleep 1
+	master=$(cat "$dir/nginx.pid")
+	workers=$(pgrep -P "$master" | paste -sd, -)
+	bench nginx 8444 "$master,$workers"
+	"$NGINX" -p "$dir" -c "$dir/nginx.conf" -s stop
+	sleep 1
+fi
@@ -0,0 +1,318 @@
+// opens tls connections to a server as fast as it answers them, and reports how many handshakes
+// it did per second and per core the server used, and the latency of each connection as an hdr
+// histogram like wrk2 writes.
+//
+//   tlsbench [-m full|resume|early] [-c connections] [-d seconds] [-p pid,...] [-o file.hgrm] https://host:port/path
+//
+// full opens every connection with a full handshake. resume resumes the session of the connection
+// before it on the same thread, and early does too and sends its request as early data. Latency
+// is from connect until the first byte of the response, so that early data counts.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "HdrHistogram.hpp"
+
+enum class Mode
+{
+	Full,
+	Resume,
+	Early
+};
+
+struct Options
+{
+	Mode mode = Mode::Full;
+	int connections = 16;
+	int seconds = 10;
+	std::vector<int> pids;
+	std::string output;
+	std::string host;
+	std::string port = "443";
+	std::string path = "/";
+	std::string command;
+};
+
+struct Results
+{
+	HdrHistogram latency;
+	int64_t handshakes = 0;
+	int64_t resumed = 0;
+	int64_t early = 0;
+	int64_t errors = 0;
+};
+
+static int64_t now_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// cpu time the processes used so far, in seconds
+static double cpu_seconds(const std::vector<int> &pids)
+{
+	double total = 0;
+	for (auto pid : pids)
+	{
+		char path[64];
+		snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+		auto f = fopen(path, "r");
+		if (!f) continue;
+
+		char buf[1024];
+		auto len = fread(buf, 1, sizeof(buf) - 1, f);
+		fclose(f);
+		buf[len] = 0;
+
+		// utime and stime are the 14th and 15th fields, counted after the command in parentheses
+		auto p = strrchr(buf, ')');
+		unsigned long long utime = 0, stime = 0;
+		if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) == 2)
+		{
+			total += static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+		}
+	}
+	return total;
+}
+
+static bool parse_url(const std::string &url, Options &o)
+{
+	const std::string scheme = "https://";
+	if (url.compare(0, scheme.size(), scheme) != 0) return false;
+
+	auto rest = url.substr(scheme.size());
+	auto slash = rest.find('/');
+	auto authority = rest.substr(0, slash);
+	if (slash != std::string::npos) o.path = rest.substr(slash);
+
+	auto colon = authority.rfind(':');
+	if (colon != std::string::npos)
+	{
+		o.port = authority.substr(colon + 1);
+		authority.resize(colon);
+	}
+	o.host = authority;
+	return !o.host.empty();
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage: tlsbench [-m full|resume|early] [-c connections] [-d seconds] [-p pid,...] [-o file.hgrm] https://host:port/path\n");
+	exit(2);
+}
+
+// keeps the newest ticket of a connection in the slot its app data points to
+static int new_session_cb(SSL *s, SSL_SESSION *session)
+{
+	auto slot = static_cast<SSL_SESSION**>(SSL_get_app_data(s));
+	if (!slot) return 0;
+	if (*slot) SSL_SESSION_free(*slot);
+	*slot = session;
+	return 1;
+}
+
+// read until some of the response came. Tickets before it don't count.
+static int read_response(SSL *ssl, char *buf, int size)
+{
+	for (;;)
+	{
+		auto n = SSL_read(ssl, buf, size);
+		if (n > 0 || SSL_get_error(ssl, n) != SSL_ERROR_WANT_READ) return n;
+	}
+}
+
+static void run(const Options &o, const addrinfo *address, SSL_CTX *ctx, int64_t deadline, Results &r)
+{
+	auto request = "GET " + o.path + " HTTP/1.1\r\nHost: " + o.host + "\r\nConnection: close\r\n\r\n";
+	SSL_SESSION *session = nullptr;
+	char buf[4096];
+
+	while (now_us() < deadline)
+	{
+		auto start = now_us();
+		int fd = socket(address->ai_family, SOCK_STREAM, 0);
+		if (fd < 0 || connect(fd, address->ai_addr, address->ai_addrlen) < 0)
+		{
+			if (fd >= 0) close(fd);
+			r.errors++;
+			continue;
+		}
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		timeval timeout{ 5, 0 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+		SSL_SESSION *next = nullptr;
+		auto ssl = SSL_new(ctx);
+		SSL_set_app_data(ssl, &next);
+		SSL_set_fd(ssl, fd);
+		SSL_set_tlsext_host_name(ssl, o.host.c_str());
+		if (session) SSL_set_session(ssl, session);
+
+		bool sent = false;
+		if (o.mode == Mode::Early && session && SSL_SESSION_get_max_early_data(session) > 0)
+		{
+			size_t written;
+			sent = SSL_write_early_data(ssl, request.data(), request.size(), &written) == 1;
+		}
+
+		bool ok = SSL_connect(ssl) == 1;
+		if (ok && (!sent || SSL_get_early_data_status(ssl) != SSL_EARLY_DATA_ACCEPTED))
+		{
+			ok = SSL_write(ssl, request.data(), static_cast<int>(request.size())) > 0;
+		}
+		ok = ok && read_response(ssl, buf, sizeof(buf)) > 0;
+
+		if (ok)
+		{
+			r.latency.record(now_us() - start);
+			r.handshakes++;
+			if (SSL_session_reused(ssl)) r.resumed++;
+			if (sent && SSL_get_early_data_status(ssl) == SSL_EARLY_DATA_ACCEPTED) r.early++;
+
+			// tls 1.3 tickets come after the handshake, and after the response to early data. A ticket
+			// that carried early data once won't again, so the next connection needs the new one.
+			if (o.mode != Mode::Full)
+			{
+				while (!next)
+				{
+					auto n = SSL_read(ssl, buf, sizeof(buf));
+					if (n <= 0 && SSL_get_error(ssl, n) != SSL_ERROR_WANT_READ) break;
+				}
+				if (session) SSL_SESSION_free(session);
+				session = next;
+				next = nullptr;
+			}
+			SSL_shutdown(ssl);
+		}
+		else
+		{
+			r.errors++;
+			ERR_clear_error();
+		}
+
+		SSL_free(ssl);
+		close(fd);
+		if (next) SSL_SESSION_free(next);
+	}
+
+	if (session) SSL_SESSION_free(session);
+}
+
+int main(int argc, char *argv[])
+{
+	Options o;
+	for (int i = 0; i < argc; i++)
+	{
+		if (i) o.command += " ";
+		o.command += argv[i];
+	}
+
+	int opt;
+	while ((opt = getopt(argc, argv, "m:c:d:p:o:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'm':
+			if (strcmp(optarg, "full") == 0) o.mode = Mode::Full;
+			else if (strcmp(optarg, "resume") == 0) o.mode = Mode::Resume;
+			else if (strcmp(optarg, "early") == 0) o.mode = Mode::Early;
+			else usage();
+			break;
+		case 'c': o.connections = std::max(1, atoi(optarg)); break;
+		case 'd': o.seconds = std::max(1, atoi(optarg)); break;
+		case 'p':
+			for (auto p = strtok(optarg, ","); p; p = strtok(nullptr, ",")) o.pids.push_back(atoi(p));
+			break;
+		case 'o': o.output = optarg; break;
+		default: usage();
+		}
+	}
+	if (optind != argc - 1 || !parse_url(argv[optind], o)) usage();
+
+	addrinfo hints{}, *address = nullptr;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(o.host.c_str(), o.port.c_str(), &hints, &address) != 0 || !address)
+	{
+		fprintf(stderr, "could not resolve %s\n", o.host.c_str());
+		return 1;
+	}
+
+	// certificates aren't verified; the point is how fast the server makes handshakes
+	auto ctx = SSL_CTX_new(TLS_client_method());
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+	// return from reads after a ticket came too, instead of waiting for more of the response
+	SSL_CTX_clear_mode(ctx, SSL_MODE_AUTO_RETRY);
+	static const unsigned char alpn[] = "\x08http/1.1";
+	SSL_CTX_set_alpn_protos(ctx, alpn, sizeof(alpn) - 1);
+
+	std::vector<Results> results(o.connections);
+	std::vector<std::thread> threads;
+	auto cpu_before = cpu_seconds(o.pids);
+	auto start = now_us();
+	auto deadline = start + static_cast<int64_t>(o.seconds) * 1000000;
+	for (int i = 0; i < o.connections; i++)
+	{
+		threads.emplace_back([&, i]() { run(o, address, ctx, deadline, results[i]); });
+	}
+	for (auto &t : threads) t.join();
+	auto elapsed = (now_us() - start) / 1e6;
+	auto cpu = cpu_seconds(o.pids) - cpu_before;
+
+	Results total;
+	for (auto &r : results)
+	{
+		total.latency.add(r.latency);
+		total.handshakes += r.handshakes;
+		total.resumed += r.resumed;
+		total.early += r.early;
+		total.errors += r.errors;
+	}
+
+	static const char *modes[] = { "full", "resume", "early" };
+	printf("%s handshakes to %s:%s for %ds over %d connections\n", modes[static_cast<int>(o.mode)], o.host.c_str(), o.port.c_str(), o.seconds, o.connections);
+	printf("  %lld handshakes, %lld resumed, %lld with early data, %lld errors\n",
+		static_cast<long long>(total.handshakes), static_cast<long long>(total.resumed),
+		static_cast<long long>(total.early), static_cast<long long>(total.errors));
+	printf("  %.1f handshakes/s", total.handshakes / elapsed);
+	if (!o.pids.empty() && cpu > 0) printf(", %.1f per server core (%.2f cores busy)", total.handshakes / cpu, cpu / elapsed);
+	printf("\n");
+	printf("  latency ms: p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+		total.latency.value_at(50) / 1000.0, total.latency.value_at(90) / 1000.0, total.latency.value_at(99) / 1000.0,
+		total.latency.value_at(99.9) / 1000.0, total.latency.max() / 1000.0);
+
+	if (!o.output.empty())
+	{
+		auto f = fopen(o.output.c_str(), "w");
+		if (!f)
+		{
+			perror(o.output.c_str());
+			return 1;
+		}
+		fprintf(f, "# %s\n", o.command.c_str());
+		total.latency.print(f, 1000.0);
+		fclose(f);
+	}
+
+	SSL_CTX_free(ctx);
+	freeaddrinfo(address);
+	return 0;
+}
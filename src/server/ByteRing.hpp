@@ -0,0 +1,94 @@
+#pragma once
+
+// a fixed size ring of bytes. Data goes in at the tail and comes out at the head, and either end
+// can be handed to a syscall directly. The memory is allocated once and only touched as it is used.
+// Not thread safe.
+class ByteRing
+{
+public:
+	ByteRing(size_t capacity)
+		: _data(new char[capacity]), _capacity(capacity), _head(0), _size(0) {}
+	ByteRing(const ByteRing&) = delete;
+	ByteRing& operator=(const ByteRing&) = delete;
+
+	inline size_t size() const { return _size; }
+	inline size_t space() const { return _capacity - _size; }
+	inline bool empty() const { return _size == 0; }
+	inline bool full() const { return _size == _capacity; }
+
+	// the data as at most two spans, oldest first. Returns how many there are.
+	int data(iovec iov[2]) const
+	{
+		if (_size == 0) return 0;
+
+		auto first = std::min(_size, _capacity - _head);
+		iov[0] = iovec{ _data.get() + _head, first };
+		if (first == _size) return 1;
+
+		iov[1] = iovec{ _data.get(), _size - first };
+		return 2;
+	}
+
+	// drop data from the head
+	void consume(size_t amt)
+	{
+		amt = std::min(amt, _size);
+		_size -= amt;
+		_head += amt;
+		if (_head >= _capacity) _head -= _capacity;
+
+		// an empty ring starts over so the free space is in one piece
+		if (_size == 0) _head = 0;
+	}
+
+	// the free space right after the data, in one piece
+	iovec free_span() const
+	{
+		auto tail = _head + _size;
+		if (tail >= _capacity) return iovec{ _data.get() + tail - _capacity, _capacity - _size };
+		return iovec{ _data.get() + tail, _capacity - tail };
+	}
+
+	// add data written into the free space
+	void commit(size_t amt)
+	{
+		_size += std::min(amt, space());
+	}
+
+	// copy in as much as fits
+	size_t put(const void* b, size_t amt)
+	{
+		auto p = static_cast<const char*>(b);
+		size_t done = 0;
+		while (done < amt && !full())
+		{
+			auto span = free_span();
+			auto n = std::min(amt - done, span.iov_len);
+			memcpy(span.iov_base, p + done, n);
+			commit(n);
+			done += n;
+		}
+		return done;
+	}
+
+	// copy out as much as there is
+	size_t get(void* b, size_t amt)
+	{
+		auto p = static_cast<char*>(b);
+		size_t done = 0;
+		while (done < amt && !empty())
+		{
+			auto n = std::min({ amt - done, _size, _capacity - _head });
+			memcpy(p + done, _data.get() + _head, n);
+			consume(n);
+			done += n;
+		}
+		return done;
+	}
+
+private:
+	std::unique_ptr<char[]> _data;
+	size_t _capacity;
+	size_t _head;
+	size_t _size;
+};
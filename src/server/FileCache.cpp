@@ -0,0 +1,317 @@
+#include "pch.hpp"
+#include "FileCache.hpp"
+
+// older headers don't know these
+#ifndef MADV_COLD
+#define MADV_COLD 20
+#endif
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT 21
+#endif
+
+
+static uint32_t now_seconds()
+{
+	return static_cast<uint32_t>(coarse_clock() / 1000);
+}
+
+// whether the file on disk is still the one that was mapped
+static bool unchanged(const MappedFile &f)
+{
+	struct stat st;
+	return stat(f.name().c_str(), &st) == 0
+		&& st.st_ino == f.inode()
+		&& static_cast<size_t>(st.st_size) == f.size()
+		&& st.st_mtim.tv_sec == f.modified().tv_sec
+		&& st.st_mtim.tv_nsec == f.modified().tv_nsec;
+}
+
+FileCache::FileCache(prepare_function prepare)
+	:_prepare(std::move(prepare))
+{
+}
+
+FileCache::~FileCache()
+{
+	{
+		std::lock_guard<std::mutex> guard(_sweep_lock);
+		_running = false;
+	}
+
+	_sweep_changed.notify_all();
+	if (_sweeper.joinable()) _sweeper.join();
+}
+
+std::shared_ptr<const CachedFile> FileCache::get(const std::string &filename)
+{
+	auto &s = _shards[std::hash<std::string>()(filename) % SHARDS];
+
+	{
+		std::shared_lock<std::shared_mutex> guard(s.lock);
+		auto found = s.files.find(filename);
+		if (found != s.files.end())
+		{
+			// only written when they change so that popular files don't bounce between cores
+			auto &e = found->second;
+			auto now = now_seconds();
+			if (!e.referenced.load(std::memory_order_relaxed)) e.referenced.store(true, std::memory_order_relaxed);
+			if (e.used.load(std::memory_order_relaxed) != now) e.used.store(now, std::memory_order_relaxed);
+			if (e.coldness.load(std::memory_order_relaxed)) e.coldness.store(0, std::memory_order_relaxed);
+
+			// the file is looked at on disk at most once a second, by one of the threads using it
+			std::shared_ptr<const CachedFile> check;
+			auto checked = e.checked.load(std::memory_order_relaxed);
+			if (checked != now && e.mapped && e.checked.compare_exchange_strong(checked, now, std::memory_order_relaxed))
+			{
+				check = e.mapped;
+			}
+
+			auto file = e.file;
+			guard.unlock();
+			if (!check || unchanged(*check)) return file.get();
+
+			// it changed, so it is mapped again below
+			remove(s, filename, check);
+		}
+	}
+
+	// whoever puts the entry in maps the file. Everyone else waits for them.
+	std::promise<std::shared_ptr<const CachedFile>> mapped;
+	loading file;
+	bool mine = false;
+	{
+		std::lock_guard<std::shared_mutex> guard(s.lock);
+		auto found = s.files.find(filename);
+		if (found != s.files.end())
+		{
+			file = found->second.file;
+		}
+		else
+		{
+			file = mapped.get_future().share();
+			auto &e = s.files.try_emplace(filename).first->second;
+			e.file = file;
+			e.used.store(now_seconds(), std::memory_order_relaxed);
+			e.checked.store(now_seconds(), std::memory_order_relaxed);
+			mine = true;
+		}
+	}
+
+	if (!mine)
+	{
+		return file.get();
+	}
+
+	try
+	{
+		auto f = std::make_shared<CachedFile>(filename);
+		if (_prepare) _prepare(*f);
+		mapped.set_value(f);
+		loaded(s, filename, std::move(f));
+		evict();
+	}
+	catch (...)
+	{
+		mapped.set_exception(std::current_exception());
+
+		// the file may be there next time
+		std::lock_guard<std::shared_mutex> guard(s.lock);
+		s.files.erase(filename);
+	}
+
+	return file.get();
+}
+
+// count a file that was just mapped against the budget. One that doesn't fit in it at all is
+// left to the requests waiting for it, instead of pushing everything else out.
+void FileCache::loaded(shard &s, const std::string &filename, std::shared_ptr<const CachedFile> file)
+{
+	std::lock_guard<std::shared_mutex> guard(s.lock);
+	auto found = s.files.find(filename);
+	if (found == s.files.end()) return;
+
+	auto size = file->size();
+	if (_max_bytes && size > _max_bytes)
+	{
+		s.files.erase(found);
+		return;
+	}
+
+	// it was just asked for, so it gets to stay until the hand has gone round once
+	auto &e = found->second;
+	e.mapped = std::move(file);
+	e.referenced.store(true, std::memory_order_relaxed);
+	s.order.push_back(filename);
+
+	s.bytes += size;
+	_bytes.fetch_add(size, std::memory_order_relaxed);
+	_files.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool FileCache::over() const
+{
+	return (_max_bytes && _bytes.load(std::memory_order_relaxed) > _max_bytes)
+		|| (_max_files && _files.load(std::memory_order_relaxed) > _max_files);
+}
+
+// evict files until the cache is within budget, moving the hand from shard to shard. Only one
+// shard is locked at a time.
+void FileCache::evict()
+{
+	// each visit goes round a shard once, so the second round over all of them evicts the files
+	// that had their second chance
+	for (size_t n = SHARDS * 2; n > 0 && over(); n--)
+	{
+		auto &s = _shards[_hand.fetch_add(1, std::memory_order_relaxed) % SHARDS];
+		std::lock_guard<std::shared_mutex> guard(s.lock);
+		evict(s);
+	}
+}
+
+// go round the files of a shard once, evicting until the cache is within budget. The lock must be
+// held for writing.
+void FileCache::evict(shard &s)
+{
+	for (size_t n = s.order.size(); n > 0 && over(); n--)
+	{
+		auto filename = std::move(s.order.front());
+		s.order.pop_front();
+
+		auto found = s.files.find(filename);
+		if (found == s.files.end()) continue;
+
+		auto &e = found->second;
+		if (e.referenced.exchange(false, std::memory_order_relaxed))
+		{
+			s.order.push_back(std::move(filename));
+			continue;
+		}
+
+		erase(s, found);
+	}
+}
+
+// forget a file that changed on disk, unless it was mapped again already
+void FileCache::remove(shard &s, const std::string &filename, const std::shared_ptr<const CachedFile> &mapped)
+{
+	std::lock_guard<std::shared_mutex> guard(s.lock);
+	auto found = s.files.find(filename);
+	if (found == s.files.end() || found->second.mapped != mapped) return;
+
+	auto in_order = std::find(s.order.begin(), s.order.end(), filename);
+	if (in_order != s.order.end()) s.order.erase(in_order);
+	erase(s, found);
+}
+
+// erase a mapped file that is no longer in the clock. The lock must be held for writing.
+void FileCache::erase(shard &s, files_map::iterator found)
+{
+	auto size = found->second.mapped->size();
+	s.bytes -= size;
+	_bytes.fetch_sub(size, std::memory_order_relaxed);
+	_files.fetch_sub(1, std::memory_order_relaxed);
+	s.files.erase(found);
+}
+
+void FileCache::set_budget(size_t bytes, size_t files)
+{
+	_max_bytes = bytes;
+	_max_files = files;
+	evict();
+}
+
+void FileCache::set_cold(uint32_t cold, uint32_t interval)
+{
+	{
+		std::lock_guard<std::mutex> guard(_sweep_lock);
+		_cold = cold;
+		_interval = interval ? interval : 1;
+	}
+
+	if (cold && !_sweeper.joinable()) _sweeper = std::thread([this]() { sweeper(); });
+	_sweep_changed.notify_all();
+}
+
+FileCache::usage_info FileCache::usage() const
+{
+	usage_info u{ 0, 0, _resident.load(std::memory_order_relaxed) };
+	for (auto &s : _shards)
+	{
+		std::shared_lock<std::shared_mutex> guard(s.lock);
+		u.files += s.files.size();
+		u.bytes += s.bytes;
+	}
+	return u;
+}
+
+void FileCache::sweeper()
+{
+	std::unique_lock<std::mutex> guard(_sweep_lock);
+	while (_running)
+	{
+		_sweep_changed.wait_for(guard, std::chrono::seconds(_interval));
+		if (!_running) break;
+		if (!_cold) continue;
+
+		auto cold = _cold;
+		guard.unlock();
+		sweep(cold);
+		guard.lock();
+	}
+}
+
+// advise the kernel about files that went cold and measure residency. The syscalls are made
+// outside of the shard locks so requests never wait for them.
+void FileCache::sweep(uint32_t cold)
+{
+	auto now = now_seconds();
+	auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	std::vector<unsigned char> pages;
+	size_t resident = 0;
+
+	for (auto &s : _shards)
+	{
+		std::vector<std::pair<std::shared_ptr<const CachedFile>, int>> files;
+		{
+			std::shared_lock<std::shared_mutex> guard(s.lock);
+			files.reserve(s.files.size());
+			for (auto &f : s.files)
+			{
+				auto &e = f.second;
+				if (!e.mapped) continue;
+
+				// a file goes cold after cold seconds, and is paged out if it stays cold until the next sweep
+				int advice = 0;
+				auto used = e.used.load(std::memory_order_relaxed);
+				if (now > used && now - used >= cold)
+				{
+					auto coldness = e.coldness.load(std::memory_order_relaxed);
+					if (coldness < 2)
+					{
+						e.coldness.store(coldness + 1, std::memory_order_relaxed);
+						advice = coldness == 0 ? MADV_COLD : MADV_PAGEOUT;
+					}
+				}
+				files.emplace_back(e.mapped, advice);
+			}
+		}
+
+		for (auto &f : files)
+		{
+			auto &file = *f.first;
+			if (file.empty()) continue;
+			auto address = const_cast<char*>(file.data());
+
+			// not every kernel knows these, and then they are only advice
+			if (f.second) madvise(address, file.size(), f.second);
+
+			pages.resize((file.size() + page - 1) / page);
+			if (mincore(address, file.size(), pages.data()) == 0)
+			{
+				for (auto p : pages) if (p & 1) resident += page;
+			}
+		}
+	}
+
+	_resident.store(resident, std::memory_order_relaxed);
+}
@@ -0,0 +1,119 @@
+#pragma once
+#include "MappedFile.h"
+
+struct prepared_headers;
+
+// a mapped file and what responses with it need. Everything but the file is set once, by the
+// cache's prepare function, before the file is shared.
+class CachedFile : public MappedFile
+{
+public:
+	CachedFile(const std::string &filename) : MappedFile(filename) {}
+
+	// without quotes
+	std::string etag;
+	// the headers of a response that sends all of it
+	std::shared_ptr<const prepared_headers> headers;
+	// the headers of a 304 for it
+	std::shared_ptr<const prepared_headers> not_modified;
+};
+
+// files mapped once and shared by every acceptor thread, spread over shards that are locked
+// separately. Hits only take a shard's lock for reading. A miss maps the file outside of the lock,
+// once, while other threads that want the same file wait for it. Responses hold on to the mapping
+// until they are sent, so it stays valid whatever happens to the cache. A file that changed on
+// disk is mapped again; hits look at the disk at most once a second.
+//
+// With a budget, files are evicted by CLOCK. The budget is for the whole cache, and the hand goes
+// round the shards, through the files of each in the order they came in, and evicts those that
+// weren't used since it last came by. Evicted files are unmapped once the last response using
+// them is done. A file bigger than the whole budget is mapped for the requests that want it but
+// not kept.
+class FileCache
+{
+public:
+	static constexpr size_t SHARDS = 16;
+
+	struct usage_info
+	{
+		size_t files;
+		size_t bytes;
+		// how much of the files was in memory when they were last swept, if they are
+		size_t resident;
+	};
+
+	using prepare_function = std::function<void(CachedFile&)>;
+
+	// prepare fills in the rest of files when they are mapped
+	FileCache(prepare_function prepare = nullptr);
+	~FileCache();
+	FileCache(const FileCache&) = delete;
+	FileCache& operator=(const FileCache&) = delete;
+
+	// the mapping of a file. Throws if it can't be mapped, and tries again next time.
+	std::shared_ptr<const CachedFile> get(const std::string &filename);
+
+	// keep at most bytes of files and at most files files, over all shards. 0 is no limit.
+	void set_budget(size_t bytes, size_t files);
+
+	// every interval seconds, tell the kernel it can reclaim the pages of files that weren't used
+	// for cold seconds, and measure how much of the cache is resident. 0 turns it off.
+	void set_cold(uint32_t cold, uint32_t interval = 10);
+
+	usage_info usage() const;
+
+private:
+	using loading = std::shared_future<std::shared_ptr<const CachedFile>>;
+
+	struct entry
+	{
+		loading file;
+		// set once the file is mapped
+		std::shared_ptr<const CachedFile> mapped;
+		// used since the clock last came by
+		std::atomic<bool> referenced{ false };
+		// when it was last used, in seconds of the coarse clock
+		std::atomic<uint32_t> used{ 0 };
+		// 0 while in use, then 1 once advised cold and 2 once paged out
+		std::atomic<int> coldness{ 0 };
+		// when it was last compared to the file on disk
+		std::atomic<uint32_t> checked{ 0 };
+	};
+	using files_map = std::unordered_map<std::string, entry>;
+
+	struct shard
+	{
+		mutable std::shared_mutex lock;
+		files_map files;
+		// the clock, with the names of the files that are mapped
+		std::deque<std::string> order;
+		size_t bytes = 0;
+	};
+
+	void loaded(shard &s, const std::string &filename, std::shared_ptr<const CachedFile> file);
+	bool over() const;
+	void evict();
+	void evict(shard &s);
+	void remove(shard &s, const std::string &filename, const std::shared_ptr<const CachedFile> &mapped);
+	void erase(shard &s, files_map::iterator found);
+	void sweeper();
+	void sweep(uint32_t cold);
+
+	prepare_function _prepare;
+	shard _shards[SHARDS];
+	size_t _max_bytes = 0;
+	size_t _max_files = 0;
+	// of the files that are mapped, in all shards
+	std::atomic<size_t> _bytes{ 0 };
+	std::atomic<size_t> _files{ 0 };
+	// the shard the clock hand is at
+	std::atomic<size_t> _hand{ 0 };
+	std::atomic<size_t> _resident{ 0 };
+
+	std::mutex _sweep_lock;
+	std::condition_variable _sweep_changed;
+	uint32_t _cold = 0;
+	uint32_t _interval = 10;
+	bool _running = true;
+	std::thread _sweeper;
+};
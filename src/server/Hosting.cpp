@@ -55,6 +55,9 @@ void reset_request(request_info &request)
 	request.dnt = false;
 	request.ranges.clear();
 	request.upgrade_insecure = false;
+	request.if_none_match.clear();
+	request.if_modified_since = 0;
+	request.if_range.clear();
 
 	request.stream_id = 0;
 	reset_response(request.response);
@@ -78,8 +81,10 @@ void reset_response(response_info &response)
 	response.content_range.end = 0;
 	response.content_range.size = 0;
 	response.content_range.start = 0;
-	response.response_data = 0;
+	response.body = body_source{ nullptr, -1, 0, 0 };
+	response.parts.clear();
 	response.data_sent = 0;
+	response.prepared.reset();
 	response._strings.clear();
 }
 
@@ -91,17 +96,24 @@ void reset_response(response_info &response, int statusCode, const std::string &
 	response.status.assign(status);
 }
 
+// most ranges answered at once. Asking for more gets the whole file.
+static constexpr size_t RANGES_MAX = 16;
+
 static std::string _sok("200 OK");
+static std::string _spartial_content("206 Partial Content");
+static std::string _snot_modified("304 Not Modified");
 static std::string _sbad_request("400 Bad Request");
 static std::string _sinternal_server_error("500 Internal Server Error");
 static std::string _snot_found("404 Not Found");
 static std::string _smethod_not_allowed("405 Method Not Allowed");
+static std::string _srange_not_satisfiable("416 Range Not Satisfiable");
+static std::string _stoo_early("425 Too Early");
 
 void response_error(response_info &response, int code, const std::string &status)
 {
-	reset_response(response, 400, status);
+	reset_response(response, code, status);
 	response.contentLength = status.size();
-	response.response_data = &status[0];
+	response.body = body_source{ &status[0], -1, 0, status.size() };
 }
 
 void response_bad_request(response_info &response)
@@ -124,18 +136,195 @@ void response_method_not_allowed(response_info &response)
 	response_error(response, 405, _smethod_not_allowed);
 }
 
-void response_ok(response_info &response, size_t content_length, std::string content_type, const void* data)
+void response_too_early(response_info &response)
+{
+	response_error(response, 425, _stoo_early);
+}
+
+void response_ok(response_info &response, size_t content_length, std::string content_type, const body_source &body)
 {
 	reset_response(response, 200, _sok);
 
 	if (content_length != static_cast<size_t>(-1)) response.contentLength = content_length;
 	if (content_type.size()) response.contentType = content_type;
-	if (data) response.response_data = data;
+	if (body.data) response.body = body;
 }
 
+void response_prepared(response_info &response, std::shared_ptr<const prepared_headers> headers, const body_source &body)
+{
+	reset_response(response);
+	response.status_code = headers->response.status_code;
+	response.contentLength = headers->response.contentLength;
+	response.prepared = std::move(headers);
+	if (body.data) response.body = body;
+}
+
+// every response with the whole of a file has the same headers, so they are serialized when the
+// file is mapped. So is the etag. It stays the same for as long as the mapping is cached, which
+// the cache ends within a second of the file being replaced or written to.
+static void prepare_file(CachedFile &f)
+{
+	char etag[64];
+	auto &modified = f.modified();
+	snprintf(etag, sizeof(etag), "%llx-%llx-%zx", static_cast<unsigned long long>(f.inode()),
+		static_cast<unsigned long long>(modified.tv_sec) * 1000000000ull + modified.tv_nsec, f.size());
+	f.etag = etag;
+
+	response_info response;
+	response_ok(response, f.size(), content_type_for(f.name()), body_source{ nullptr, -1, 0, 0 });
+	response.etag = f.etag;
+	response.lastModified = static_cast<int>(modified.tv_sec);
+	response.acceptRanges = true;
+	f.headers = prepare_headers(response);
+
+	// caches already have the rest of the headers
+	reset_response(response, 304, _snot_modified);
+	response.etag = f.etag;
+	f.not_modified = prepare_headers(response);
+}
+
+// whether the copy the client has is still good. If-None-Match wins over If-Modified-Since, and
+// its tags are compared weakly, as rfc 9110 says to.
+static bool is_not_modified(const request_info &request, const CachedFile &f)
+{
+	if (!request.if_none_match.empty())
+	{
+		const auto &tags = request.if_none_match;
+		size_t pos = 0;
+		while (pos < tags.size())
+		{
+			auto end = tags.find(',', pos);
+			if (end == std::string::npos) end = tags.size();
+
+			auto start = tags.find_first_not_of(" \t", pos);
+			auto last = tags.find_last_not_of(" \t", end - 1);
+			if (start != std::string::npos && start < end && last != std::string::npos && last >= start)
+			{
+				const char *tag = &tags[start];
+				size_t size = last - start + 1;
+				if (size == 1 && *tag == '*') return true;
+				if (size > 2 && tag[0] == 'W' && tag[1] == '/') { tag += 2; size -= 2; }
+				if (size == f.etag.size() + 2 && tag[0] == '"' && tag[size - 1] == '"' && memcmp(tag + 1, f.etag.data(), f.etag.size()) == 0) return true;
+			}
+
+			pos = end + 1;
+		}
+		return false;
+	}
+
+	return request.if_modified_since != 0 && f.modified().tv_sec <= request.if_modified_since;
+}
+
+
+// whether ranges are of the file the client has part of. If-Range only matches an exact strong
+// etag or the exact modification time.
+static bool if_range_matches(const request_info &request, const CachedFile &f)
+{
+	const auto &value = request.if_range;
+	if (value.empty()) return true;
+
+	if (value[0] == '"')
+	{
+		return value.size() == f.etag.size() + 2 && value.back() == '"' && value.compare(1, f.etag.size(), f.etag) == 0;
+	}
+	return parse_date(value) == f.modified().tv_sec;
+}
+
+// answers a GET for ranges of a file with 206, or 416 if none are in it. The body is slices of
+// the mapping, and several ranges are sorted, merged and sent as multipart/byteranges. Returns
+// false when the whole file should be sent instead.
+static bool response_ranges(request_info &request, const std::shared_ptr<const CachedFile> &f)
+{
+	if (request.ranges.empty() || request.ranges.size() > RANGES_MAX || !if_range_matches(request, *f)) return false;
+
+	auto &response = request.response;
+	auto size = f->size();
+
+	content_range found[RANGES_MAX];
+	size_t count = 0;
+	for (auto &r : request.ranges)
+	{
+		if (r.start == static_cast<size_t>(-1))
+		{
+			// an empty file has no last bytes to send
+			if (r.end == 0 || size == 0) continue;
+			found[count++] = content_range{ size - std::min(r.end, size), size - 1, size };
+		}
+		else if (r.start < size)
+		{
+			found[count++] = content_range{ r.start, std::min(r.end, size - 1), size };
+		}
+	}
+
+	if (count == 0)
+	{
+		response_error(response, 416, _srange_not_satisfiable);
+		response.content_range = content_range{ 0, 0, size };
+		return true;
+	}
 
+	// asking for more than the file, like the same range over and over, gets the file once
+	size_t total = 0;
+	for (size_t i = 0; i < count; i++) total += found[i].end - found[i].start + 1;
+	if (total > size) return false;
+
+	// overlapping and adjacent ranges are sent as one
+	std::sort(found, found + count, [](const content_range &a, const content_range &b) { return a.start < b.start; });
+	size_t merged = 0;
+	for (size_t i = 1; i < count; i++)
+	{
+		if (found[i].start <= found[merged].end + 1) found[merged].end = std::max(found[merged].end, found[i].end);
+		else found[++merged] = found[i];
+	}
+	count = merged + 1;
+
+	const auto &whole = f->headers->response;
+	reset_response(response, 206, _spartial_content);
+	response.acceptRanges = true;
+	response.etag = whole.etag;
+	response.lastModified = whole.lastModified;
+
+	if (count == 1)
+	{
+		auto &r = found[0];
+		response.contentType = whole.contentType;
+		response.content_range = r;
+		response.contentLength = r.end - r.start + 1;
+		response.body = body_source{ f->data() + r.start, f->descriptor(), static_cast<off_t>(r.start), response.contentLength, f };
+		return true;
+	}
+
+	// the text between the parts is written first, so the parts can point into it
+	auto boundary = "myne-" + f->etag;
+	auto text = std::make_shared<std::string>();
+	size_t offsets[RANGES_MAX + 1];
+	for (size_t i = 0; i < count; i++)
+	{
+		offsets[i] = text->size();
+		*text += "\r\n--" + boundary + "\r\n";
+		*text += "Content-Type: " + whole.contentType + "\r\n";
+		*text += "Content-Range: bytes " + std::to_string(found[i].start) + "-" + std::to_string(found[i].end) + "/" + std::to_string(size) + "\r\n\r\n";
+	}
+	offsets[count] = text->size();
+	*text += "\r\n--" + boundary + "--\r\n";
+
+	response.contentType = "multipart/byteranges; boundary=" + boundary;
+	response.parts.reserve(count * 2 + 1);
+	for (size_t i = 0; i < count; i++)
+	{
+		auto &r = found[i];
+		response.parts.emplace_back(body_source{ text->data() + offsets[i], -1, 0, offsets[i + 1] - offsets[i], text });
+		response.parts.emplace_back(body_source{ f->data() + r.start, f->descriptor(), static_cast<off_t>(r.start), r.end - r.start + 1, f });
+	}
+	response.parts.emplace_back(body_source{ text->data() + offsets[count], -1, 0, text->size() - offsets[count], text });
+
+	response.contentLength = 0;
+	for (auto &part : response.parts) response.contentLength += part.size;
+	return true;
+}
 
 StaticHosting::StaticHosting(const std::string &root)
+	:_files(prepare_file)
 {
 	if (root.size() == 0)
 	{
@@ -188,16 +377,23 @@ bool StaticHosting::request(request_info &request)
 
 	try
 	{
-		auto &f = file(full_path);
+		auto f = _files.get(full_path);
 		auto &response = request.response;
 
-		if (request.method == Method::GET)
+		if ((request.method == Method::GET || request.method == Method::HEAD) && is_not_modified(request, *f))
+		{
+			response_prepared(response, f->not_modified, body_source{ nullptr, -1, 0, 0 });
+		}
+		else if (request.method == Method::GET)
 		{
-			response_ok(response, f.size(), content_type_for(f.name()), &f[0]);
+			if (!response_ranges(request, f))
+			{
+				response_prepared(response, f->headers, body_source{ f->data(), f->descriptor(), 0, f->size(), f });
+			}
 		}
 		else if (request.method == Method::HEAD)
 		{
-			response_ok(response, f.size(), content_type_for(f.name()), nullptr);
+			response_prepared(response, f->headers, body_source{ nullptr, -1, 0, 0 });
 		}
 		else
 		{
@@ -211,17 +407,3 @@ bool StaticHosting::request(request_info &request)
 		return false;
 	}
 }
-
-const MappedFile &StaticHosting::file(const std::string &filename)
-{
-	auto file = _files.find(filename);
-	if (file != _files.cend())
-	{
-		return file->second;
-	}
-	else
-	{
-		auto r = _files.emplace(filename, filename);
-		return r.first->second;
-	}
-}
\ No newline at end of file
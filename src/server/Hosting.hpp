@@ -1,16 +1,22 @@
 #pragma once
-#include "MappedFile.h"
+#include "FileCache.hpp"
 
 
 class response_info;
 class request_info;
+struct prepared_headers;
 void reset_request(request_info &request);
 void reset_response(response_info &response);
 void reset_response(response_info &response, int statusCode, const std::string &status);
 void response_bad_request(response_info &response);
 void response_internal_server_error(response_info &response);
 void response_not_found(response_info &response);
-void response_ok(response_info &response, size_t content_length, std::string content_type, const void* data);
+void response_too_early(response_info &response);
+struct body_source;
+void response_ok(response_info &response, size_t content_length, std::string content_type, const body_source &body);
+void response_prepared(response_info &response, std::shared_ptr<const prepared_headers> headers, const body_source &body);
+std::shared_ptr<const prepared_headers> prepare_headers(const response_info &response);
+time_t parse_date(const std::string &value);
 
 
 enum class Method
@@ -41,8 +47,8 @@ struct keep_alive
 
 struct range
 {
-	size_t start;
-	size_t end; // -1 is no end
+	size_t start;	// -1 for the last end bytes
+	size_t end;		// inclusive. -1 is no end
 };
 
 struct content_range
@@ -52,6 +58,17 @@ struct content_range
 	size_t size;
 };
 
+// where the body of a response comes from. Bodies read from a file also carry the file so they can
+// be sent without copying them through user space.
+struct body_source
+{
+	const char* data;
+	int fd;			// -1 when the body is only in memory
+	off_t offset;	// where data starts in the file
+	size_t size;
+	std::shared_ptr<const void> owner;	// keeps data and fd valid until the response is done with them
+};
+
 struct strict_transport_security
 {
 	size_t max_age;
@@ -78,12 +95,26 @@ struct response_info
 	bool acceptRanges;
 	struct content_range content_range;
 
-	const void* response_data;
+	body_source body;
+	// the body of a multipart response, one part after the other. body is empty then.
+	std::vector<body_source> parts;
 	size_t data_sent;
 
+	// headers serialized ahead of time. When set they are sent instead of the fields above.
+	std::shared_ptr<const prepared_headers> prepared;
+
 	std::vector<std::string> _strings;
 };
 
+// the headers of a response that is the same every time, serialized once for http/1 and http/2.
+// Only the date and the connection are added to them when they are sent.
+struct prepared_headers
+{
+	std::vector<char> http1;		// the status line and headers, without the blank line after them
+	std::vector<nghttp2_nv> http2;	// pointing into response
+	response_info response;
+};
+
 struct request_info
 {
 	request_info() {}
@@ -101,6 +132,9 @@ struct request_info
 	bool dnt;
 	std::vector<range> ranges;
 	bool upgrade_insecure;
+	std::string if_none_match;
+	time_t if_modified_since; // 0 when not sent or not a date
+	std::string if_range;
 
 	int stream_id;
 	response_info response;
@@ -122,9 +156,9 @@ public:
 	StaticHosting(const std::string &root);
 	~StaticHosting();
 	virtual bool request(request_info &request);
-private:
-	const MappedFile &file(const std::string&);
 
-	std::unordered_map<std::string, MappedFile> _files;
+	inline FileCache &cache() { return _files; }
+private:
+	FileCache _files;
 	std::string _root;
 };
@@ -2,6 +2,95 @@
 #include "Listener.hpp"
 #include "Http.hpp"
 
+// sizes of the buffers http/1 connections read into
+static constexpr size_t READ_BUFFER_MIN = 4096;
+static constexpr size_t READ_BUFFER_MAX = 64 * 1024;
+static constexpr size_t READ_BUFFER_POOL = 64;
+
+// most buffers handed to one writev
+static constexpr int WRITE_IOV_MAX = 64;
+
+// file bodies at least this big are sent with sendfile when the socket can. Smaller ones go out
+// in the same writev as their headers.
+static constexpr size_t SENDFILE_MIN = 16 * 1024;
+
+// an http date in any of the three formats rfc 9110 says to accept, or 0
+time_t parse_date(const std::string &value)
+{
+	static const char *formats[] =
+	{
+		"%a, %d %b %Y %H:%M:%S GMT",
+		"%A, %d-%b-%y %H:%M:%S GMT",
+		"%a %b %e %H:%M:%S %Y"
+	};
+
+	for (auto format : formats)
+	{
+		tm ti{};
+		auto end = strptime(value.c_str(), format, &ti);
+		if (end && !*end) return timegm(&ti);
+	}
+	return 0;
+}
+
+// a number of at most 18 digits, so it can't overflow
+static bool parse_size(const char *s, size_t len, size_t &value)
+{
+	if (len == 0 || len > 18) return false;
+
+	value = 0;
+	for (size_t i = 0; i < len; i++)
+	{
+		if (s[i] < '0' || s[i] > '9') return false;
+		value = value * 10 + static_cast<size_t>(s[i] - '0');
+	}
+	return true;
+}
+
+// the ranges of a Range header. A header that isn't a valid list of byte ranges is ignored, as
+// rfc 9110 says, and leaves no ranges.
+static void parse_ranges(const std::string &value, std::vector<range> &ranges)
+{
+	ranges.clear();
+	if (!startswith(value, "bytes=")) return;
+
+	size_t pos = 6;
+	while (pos < value.size())
+	{
+		auto end = value.find(',', pos);
+		if (end == std::string::npos) end = value.size();
+		auto start = value.find_first_not_of(" \t", pos);
+		auto last = value.find_last_not_of(" \t", end - 1);
+		pos = end + 1;
+
+		// empty elements are allowed
+		if (start == std::string::npos || start >= end || last < start) continue;
+
+		const char *spec = &value[start];
+		size_t size = last - start + 1;
+		auto dash = static_cast<const char*>(memchr(spec, '-', size));
+		if (!dash)
+		{
+			ranges.clear();
+			return;
+		}
+
+		size_t first_len = static_cast<size_t>(dash - spec);
+		size_t last_len = size - first_len - 1;
+		range r{ static_cast<size_t>(-1), static_cast<size_t>(-1) };
+		bool valid = first_len == 0
+			? parse_size(dash + 1, last_len, r.end)
+			: parse_size(spec, first_len, r.start) && (last_len == 0 || (parse_size(dash + 1, last_len, r.end) && r.end >= r.start));
+		if (!valid)
+		{
+			ranges.clear();
+			return;
+		}
+
+		ranges.push_back(r);
+	}
+}
+
 void process_header(request_info *request, const char *name, size_t namelen, std::string value)
 {
 	if (s_eq(name, namelen, ":method"))
@@ -44,6 +133,10 @@ void process_header(request_info *request, const char *name, size_t namelen, std
 	else if (s_eq(name, namelen, "Cookie")) request->cookie = value;
 	else if (s_eq(name, namelen, "DNT")) request->dnt = value == "1";
 	else if (s_eq(name, namelen, "Upgrade")) request->upgrade_insecure = value == "1";
+	else if (s_eq(name, namelen, "If-None-Match")) request->if_none_match = value;
+	else if (s_eq(name, namelen, "If-Modified-Since")) request->if_modified_since = parse_date(value);
+	else if (s_eq(name, namelen, "Range")) parse_ranges(value, request->ranges);
+	else if (s_eq(name, namelen, "If-Range")) request->if_range = value;
 }
 
 void process_header(request_info *request, const char *name, size_t namelen, const char *value, size_t valuelen)
@@ -122,39 +215,63 @@ std::string serialize_date(time_t date)
 	return result;
 }
 
+// the value of date headers, formatted again once a second on each thread
+static constexpr size_t HTTP_DATE_SIZE = 29;
+static const char *http_date()
+{
+	static thread_local time_t formatted = 0;
+	static thread_local char date[HTTP_DATE_SIZE + 1];
+
+	auto now = time(nullptr);
+	if (now != formatted)
+	{
+		tm ti;
+		gmtime_r(&now, &ti);
+		// the server never sets a locale, so these are the english names http wants
+		strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &ti);
+		formatted = now;
+	}
+	return date;
+}
+
+// the value of a Content-Range header. A 416 gives the size only, which may be 0.
+static std::string serialize_content_range(const response_info &r)
+{
+	std::string result("bytes ");
+	if (r.status_code == 416)
+	{
+		result += "*";
+	}
+	else
+	{
+		result += std::to_string(r.content_range.start);
+		result += "-";
+		result += std::to_string(r.content_range.end);
+	}
+	result += "/";
+	result += std::to_string(r.content_range.size);
+	return result;
+}
+
+// the status line and headers, without what serialize_headers_tail adds
 std::vector<char> serialize_headers_http1(const response_info& r)
 {
 	std::string output;
 	output += "HTTP/1.1 ";
-	output += std::to_string(r.status_code);
-	output += " ";
 	output += r.status;
 	output += "\r\n";
 
 	if (r.acceptRanges) output += "Accept-Ranges: bytes\r\n";
-	if (r.connection == Connection::Close) output += "Connection: close\r\n";
-	else if (r.connection == Connection::KeepAlive) output += "Connection: keep-alive\r\n";
 	if (r.contentEncoding.size() > 0) output += "Content-Encoding: " + r.contentEncoding + "\r\n";
-	if (r.contentLength >= 0)
+	// a 304 has no body, and a length would have to be that of the body it stands for
+	if (r.status_code != 304)
 	{
 		output += "Content-Length: ";
 		output += std::to_string(r.contentLength);
 		output += "\r\n";
 	}
 	if (r.contentType.size() > 0) output += "Content-Type: " + r.contentType + "\r\n";
-	if (r.content_range.end != 0)
-	{
-		output += "Content-Range: bytes ";
-		output += std::to_string(r.content_range.start);
-		output += "-";
-		output += std::to_string(r.content_range.end);
-		if (r.content_range.size > 0)
-		{
-			output += "/";
-			output += std::to_string(r.content_range.size);
-		}
-		output += "\r\n";
-	}
+	if (r.content_range.size != 0 || r.status_code == 416) output += "Content-Range: " + serialize_content_range(r) + "\r\n";
 	if (r.etag.size() > 0) output += "ETag: \"" + r.etag + "\"\r\n";
 	if (r.lastModified != 0) output += "Last-Modified: " + serialize_date(r.lastModified) + "\r\n";
 	if (r.location.size() > 0) output += "Location: " + r.location + "\r\n";
@@ -165,10 +282,25 @@ std::vector<char> serialize_headers_http1(const response_info& r)
 		output += r.tk;
 		output += "\r\n";
 	}
-	output += "\r\n";
 	return std::vector<char>(output.begin(), output.end());
 }
 
+// the headers that are different for every response, and the blank line that ends them. out has
+// to have room for _response::TAIL_MAX.
+static size_t serialize_headers_tail(char *out, const response_info &r)
+{
+	auto p = out;
+	auto put = [&p](const char *s, size_t len) { memcpy(p, s, len); p += len; };
+
+	put("Date: ", 6);
+	put(http_date(), HTTP_DATE_SIZE);
+	put("\r\n", 2);
+	if (r.connection == Connection::Close) put("Connection: close\r\n", 19);
+	else if (r.connection == Connection::KeepAlive) put("Connection: keep-alive\r\n", 24);
+	put("\r\n", 2);
+	return static_cast<size_t>(p - out);
+}
+
 void emplace_http2_header(std::vector<nghttp2_nv> &v, const char* name, size_t namelen, const char* value, size_t valuelen)
 {
 	v.emplace_back(nghttp2_nv
@@ -211,6 +343,8 @@ std::vector<nghttp2_nv> serialize_headers_http2(response_info &r)
 	static std::string s_keep_alive("keep-alive");
 
 	std::vector<nghttp2_nv> headers;
+	// the headers point into these, so they must not move
+	r._strings.reserve(r._strings.size() + 4);
 
 	emplace_http2_header(headers, h_status, &r.status[0], 3);
 
@@ -219,22 +353,10 @@ std::vector<nghttp2_nv> serialize_headers_http2(response_info &r)
 	if (r.connection == Connection::Close) emplace_http2_header(headers, h_connection, s_close);
 	else if (r.connection == Connection::KeepAlive) emplace_http2_header(headers, h_connection, s_keep_alive);
 	if (r.contentEncoding.size() > 0) emplace_http2_header(headers, h_content_encoding, r.contentEncoding);
-	if (r.contentLength >= 0) emplace_http2_header(headers, h_content_length, r._strings.emplace_back(std::to_string(r.contentLength)));
+	if (r.status_code != 304) emplace_http2_header(headers, h_content_length, r._strings.emplace_back(std::to_string(r.contentLength)));
 	if (r.contentType.size() > 0) emplace_http2_header(headers, h_content_type, r.contentType);
-	if (r.content_range.end != 0)
-	{
-		std::string content_range("bytes ");
-		content_range += std::to_string(r.content_range.start);
-		content_range += "-";
-		content_range += std::to_string(r.content_range.end);
-		if (r.content_range.size > 0)
-		{
-			content_range += "/";
-			content_range += std::to_string(r.content_range.size);
-		}
-		emplace_http2_header(headers, h_content_range, r._strings.emplace_back(content_range));
-	}
-	if (r.etag.size() > 0) emplace_http2_header(headers, h_etag, r.etag);
+	if (r.content_range.size != 0 || r.status_code == 416) emplace_http2_header(headers, h_content_range, r._strings.emplace_back(serialize_content_range(r)));
+	if (r.etag.size() > 0) emplace_http2_header(headers, h_etag, r._strings.emplace_back("\"" + r.etag + "\""));
 	if (r.lastModified != 0) emplace_http2_header(headers, h_last_modified, r._strings.emplace_back(serialize_date(r.lastModified)));
 	if (r.location.size() > 0) emplace_http2_header(headers, h_location, r.location);
 	if (r.setCookie.size() > 0) emplace_http2_header(headers, h_set_cookie, r.setCookie);
@@ -243,9 +365,46 @@ std::vector<nghttp2_nv> serialize_headers_http2(response_info &r)
 	return headers;
 }
 
+std::shared_ptr<const prepared_headers> prepare_headers(const response_info &response)
+{
+	auto p = std::make_shared<prepared_headers>();
+	p->response = response;
+	p->response.body = body_source{ nullptr, -1, 0, 0 };
+	p->response.connection = Connection::None;
+	p->response.prepared.reset();
+	p->response._strings.clear();
+
+	p->http1 = serialize_headers_http1(p->response);
+	p->http2 = serialize_headers_http2(p->response);
+	return p;
+}
+
+
+// read buffers are only held by a connection while it reads, and otherwise kept for the next
+// connection on the same thread
+static thread_local std::vector<std::vector<char>> read_buffers;
+
+static std::vector<char> take_read_buffer(size_t size)
+{
+	std::vector<char> buffer;
+	if (!read_buffers.empty())
+	{
+		buffer = std::move(read_buffers.back());
+		read_buffers.pop_back();
+	}
+
+	buffer.resize(size);
+	return buffer;
+}
+
+static void return_read_buffer(std::vector<char> &&buffer)
+{
+	if (read_buffers.size() < READ_BUFFER_POOL) read_buffers.emplace_back(std::move(buffer));
+}
+
 
 HttpHandler::HttpHandler(HttpServer &http, std::shared_ptr<Socket> socket)
-	: _done(false), _http(http), _socket(socket), _parser(parser_callbacks(), HttpParserType::Request)
+	: _done(false), _throttled(false), _in_request(true), _deadline(Deadline::Header), _read_size(READ_BUFFER_MIN), _http(http), _socket(socket), _parser(parser_callbacks(), HttpParserType::Request)
 {
 }
 
@@ -255,37 +414,94 @@ void HttpHandler::read_avail()
 }
 
 void HttpHandler::write_avail()
+{
+	flush();
+
+	// pick up the requests we stopped reading when too many were pending
+	if (_throttled && _socket && pending_responses.size() < _http.max_pipeline())
+	{
+		process();
+	}
+}
+
+// write everything pending in one writev, headers and bodies in request order
+void HttpHandler::flush()
 {
 	if (!_socket) return;
 
+	auto from_file = [this](const _response &r)
+	{
+		return r.body.fd != -1 && r.body.size >= SENDFILE_MIN && _socket->can_sendfile();
+	};
+
+	bool progress = false;
 	while (!_done && pending_responses.size() > 0)
 	{
-		auto &r = pending_responses[pending_responses.size() - 1];
-		auto headers_left = r.headers.size() - r.headers_written;
-		auto body_left = r.body ? r.body_size - r.body_written : 0;
+		// once its headers are out, a file body goes straight from the file to the socket
+		auto &front = pending_responses.front();
+		if (front.headers_written == front.headers_size() && from_file(front))
+		{
+			auto amt = _socket->sendfile(front.body.fd, front.body.offset + front.body_written, front.body.size - front.body_written);
+			if (amt == 0) { _done = true; break; }
+			else if (amt < 0) break;
+
+			// keep going until the socket says it is full
+			front.body_written += static_cast<size_t>(amt);
+			progress = true;
+			if (front.body_written == front.body.size) pending_responses.pop_front();
+			continue;
+		}
 
-		if (headers_left > 0)
+		iovec iov[WRITE_IOV_MAX];
+		int n = 0;
+		size_t total = 0;
+		for (auto &r : pending_responses)
 		{
-			auto written = _socket->write(&r.headers[r.headers_written], headers_left);
-			if (written == 0) { _done = true; break; }
-			else if (written < 0) break;
+			if (n + 3 > WRITE_IOV_MAX) break;
 
-			r.headers_written += written;
-			continue;
+			auto head = r.head_size();
+			if (r.headers_written < head) iov[n++] = iovec{ const_cast<char*>(r.head()) + r.headers_written, head - r.headers_written };
+			auto tail_written = r.headers_written > head ? r.headers_written - head : 0;
+			if (tail_written < r.tail_size) iov[n++] = iovec{ r.tail + tail_written, r.tail_size - tail_written };
+			total += r.headers_size() - r.headers_written;
+
+			// nothing after a file body can be gathered until it is sent
+			if (from_file(r)) break;
+
+			auto body_left = r.body.size - r.body_written;
+			if (body_left > 0) iov[n++] = iovec{ const_cast<char*>(r.body.data) + r.body_written, body_left };
+			total += body_left;
 		}
-		else if (body_left > 0)
+
+		size_t written = 0;
+		if (n > 0)
 		{
-			auto written = _socket->write(r.body + r.body_written, body_left);
-			if (written == 0) { _done = true; break; }
-			else if (written < 0) break;
+			auto amt = _socket->writev(iov, n);
+			if (amt == 0) { _done = true; break; }
+			else if (amt < 0) break;
 
-			r.body_written += written;
-			continue;
+			written = static_cast<size_t>(amt);
+			progress = true;
 		}
-		else
+
+		// move past what was written and drop the responses that are done
+		auto left = written;
+		while (pending_responses.size() > 0)
 		{
-			pending_responses.pop_back();
+			auto &r = pending_responses.front();
+			auto h = std::min(left, r.headers_size() - r.headers_written);
+			r.headers_written += h;
+			left -= h;
+			auto b = std::min(left, r.body.size - r.body_written);
+			r.body_written += b;
+			left -= b;
+
+			if (r.headers_written < r.headers_size() || r.body_written < r.body.size) break;
+			pending_responses.pop_front();
 		}
+
+		// a short write means the socket is full
+		if (written < total) break;
 	}
 
 	if (_done && _socket)
@@ -293,6 +509,8 @@ void HttpHandler::write_avail()
 		_socket->close();
 		_socket.reset();
 	}
+
+	update_deadline(progress);
 }
 
 void HttpHandler::closed()
@@ -305,22 +523,39 @@ void HttpHandler::process()
 {
 	if (!_socket) return;
 
-	char buffer[2048];
-	auto amt = _socket->read(buffer, sizeof(buffer));
-
-	bool eof = false;
-	if (_done || amt == 0)
+	// sockets are edge triggered so read until there is nothing left
+	auto buffer = take_read_buffer(_read_size);
+	bool eof = _done;
+	_throttled = false;
+	while (!eof && _socket)
 	{
-		eof = true;
-	}
-	else if (amt > 0)
-	{
-		auto r = _parser.feed(buffer, amt);
-		if (static_cast<ssize_t>(r) != amt)
+		if (pending_responses.size() >= _http.max_pipeline())
+		{
+			// answer what we have. If the client does not take it we stop reading until it does.
+			flush();
+			if (pending_responses.size() >= _http.max_pipeline())
+			{
+				_throttled = true;
+				break;
+			}
+			continue;
+		}
+
+		auto amt = _socket->read(&buffer[0], buffer.size());
+		if (amt < 0) break;
+
+		if (amt == 0 || _parser.feed(&buffer[0], amt) != static_cast<size_t>(amt))
 		{
 			eof = true;
 		}
+		else if (static_cast<size_t>(amt) == buffer.size() && buffer.size() < READ_BUFFER_MAX)
+		{
+			// a full buffer means there is probably more. Read in bigger chunks.
+			_read_size = buffer.size() * 2;
+			buffer.resize(_read_size);
+		}
 	}
+	return_read_buffer(std::move(buffer));
 
 	if (eof)
 	{
@@ -331,6 +566,34 @@ void HttpHandler::process()
 			_socket.reset();
 		}
 	}
+
+	// answer everything this read produced together
+	if (pending_responses.size() > 0) flush();
+	else update_deadline(false);
+}
+
+// move the connection timeout along with what the connection is waiting for
+void HttpHandler::update_deadline(bool progress)
+{
+	if (!_socket) return;
+
+	auto deadline = Deadline::Idle;
+	if (pending_responses.size() > 0) deadline = Deadline::Write;
+	else if (_in_request) deadline = Deadline::Header;
+
+	// a write deadline restarts whenever something was written. The others only when entered,
+	// so a client trickling in a request does not keep the connection alive.
+	if (deadline != _deadline || (deadline == Deadline::Write && progress))
+	{
+		_socket->set_deadline(deadline);
+		_deadline = deadline;
+	}
+}
+
+void HttpHandler::on_message_begin()
+{
+	_in_request = true;
+	reset_request(request);
 }
 
 void HttpHandler::on_url(std::string method, std::string url)
@@ -368,13 +631,24 @@ void HttpHandler::on_body(const char* b, size_t l)
 
 void HttpHandler::on_message_complete()
 {
+	_in_request = false;
+
+	// early data can be replayed, so only requests that are safe to repeat are answered from it
 	bool handled = false;
-	for (auto h : _http)
+	if (_socket && _socket->early_data() && request.method != Method::GET && request.method != Method::HEAD)
+	{
+		response_too_early(request.response);
+		handled = true;
+	}
+	else
 	{
-		if (h->request(request))
+		for (auto h : _http)
 		{
-			handled = true;
-			break;
+			if (h->request(request))
+			{
+				handled = true;
+				break;
+			}
 		}
 	}
 
@@ -383,16 +657,23 @@ void HttpHandler::on_message_complete()
 		response_not_found(request.response);
 	}
 
-	pending_responses.emplace_back(
-		serialize_headers_http1(request.response),
-		static_cast<const char*>(request.response.response_data),
-		request.response.contentLength);
+	auto &response = request.response;
+	if (response.prepared) pending_responses.emplace_back(response.prepared, response.body);
+	else pending_responses.emplace_back(serialize_headers_http1(response), response.body);
+
+	auto &pending = pending_responses.back();
+	pending.tail_size = serialize_headers_tail(pending.tail, response);
+
+	// the parts of a multipart body follow as responses without headers. They count towards
+	// max_pipeline like the others, which only means we wait for them to go before reading more.
+	for (auto &part : response.parts) pending_responses.emplace_back(std::vector<char>(), part);
 }
 
 HttpParserCallbacks HttpHandler::parser_callbacks()
 {
 	return HttpParserCallbacks
 	{
+		std::bind(&HttpHandler::on_message_begin, this),
 		[this](std::string m, std::string u) { on_url(m, u); },
 		[this](int i, std::string s) { on_status(i, s); },
 		[this](std::string a, std::string b) { on_header(a, b); },
@@ -447,7 +728,7 @@ int http2_send_data(nghttp2_session *session, nghttp2_frame *frame, const uint8_
 }
 
 Http2Handler::Http2Handler(HttpServer &http, std::shared_ptr<Socket> socket)
-	:_http(http), _socket(socket), _session(nullptr)
+	:_http(http), _socket(socket), _session(nullptr), _deadline(Deadline::Header), _progress(false)
 {
 	nghttp2_session_callbacks *callbacks = nullptr;
 	nghttp2_session_callbacks_new(&callbacks);
@@ -494,6 +775,7 @@ void Http2Handler::read_avail()
 	if (_session)
 	{
 		nghttp2_session_recv(_session);
+		update_deadline();
 	}
 }
 
@@ -502,9 +784,24 @@ void Http2Handler::write_avail()
 	if (_session)
 	{
 		nghttp2_session_send(_session);
+		update_deadline();
 	}
 }
 
+// any traffic restarts the deadline. Streams are multiplexed so there is no header state.
+void Http2Handler::update_deadline()
+{
+	if (!_socket || !_session) return;
+
+	auto deadline = nghttp2_session_want_write(_session) ? Deadline::Write : Deadline::Idle;
+	if (deadline != _deadline || _progress)
+	{
+		_socket->set_deadline(deadline);
+		_deadline = deadline;
+	}
+	_progress = false;
+}
+
 void Http2Handler::closed()
 {
 
@@ -524,6 +821,7 @@ ssize_t Http2Handler::_recv(uint8_t *buf, size_t length, int flags)
 		return NGHTTP2_ERR_WOULDBLOCK;
 	}
 
+	_progress = true;
 	return amt;
 }
 
@@ -542,6 +840,7 @@ ssize_t Http2Handler::_send(const uint8_t *data, size_t length, int flags)
 		return NGHTTP2_ERR_WOULDBLOCK;
 	}
 
+	_progress = true;
 	return amt;
 }
 
@@ -559,12 +858,21 @@ int Http2Handler::_on_frame_recv(const nghttp2_frame *frame)
 				bool handled = false;
 				auto &stream = sttr->second;
 
-				for (auto h : _http)
+				// early data can be replayed, so only requests that are safe to repeat are answered from it
+				if (_socket->early_data() && stream.method != Method::GET && stream.method != Method::HEAD)
+				{
+					response_too_early(stream.response);
+					handled = true;
+				}
+				else
 				{
-					if (h->request(stream))
+					for (auto h : _http)
 					{
-						handled = true;
-						break;
+						if (h->request(stream))
+						{
+							handled = true;
+							break;
+						}
 					}
 				}
 
@@ -573,12 +881,29 @@ int Http2Handler::_on_frame_recv(const nghttp2_frame *frame)
 					response_not_found(stream.response);
 				}
 
-				std::vector<nghttp2_nv> response_headers = serialize_headers_http2(stream.response);
+				// nghttp2 copies the list, so one per thread will do
+				static thread_local std::vector<nghttp2_nv> response_headers;
+				auto &response = stream.response;
+				if (response.prepared) response_headers.assign(response.prepared->http2.begin(), response.prepared->http2.end());
+				else response_headers = serialize_headers_http2(response);
+
+				// and the date, which changes, it copies too
+				static const char h_date[] = "date";
+				response_headers.emplace_back(nghttp2_nv
+					{
+						const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(h_date)),
+						const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(http_date())),
+						sizeof(h_date) - 1,
+						HTTP_DATE_SIZE,
+						NGHTTP2_NV_FLAG_NO_COPY_NAME
+					});
 
 				nghttp2_data_provider response_data;
 				response_data.source.ptr = this;
 				response_data.read_callback = http2_read;
-				return nghttp2_submit_response(_session, stream.stream_id, &response_headers[0], response_headers.size(), &response_data);
+				// without a body the headers end the stream
+				bool body = response.body.size || !response.parts.empty();
+				return nghttp2_submit_response(_session, stream.stream_id, &response_headers[0], response_headers.size(), body ? &response_data : nullptr);
 			}
 		}
 	}
@@ -591,6 +916,7 @@ int Http2Handler::_on_begin_headers(const nghttp2_frame *frame)
 	auto stream_id = frame->hd.stream_id;
 	auto strr = _streams.emplace(stream_id, request_info{});
 	if (!strr.second) return -1;
+	reset_request(strr.first->second);
 	strr.first->second.stream_id = stream_id;
 
 	return 0;
@@ -622,20 +948,39 @@ ssize_t Http2Handler::_read(int32_t stream_id, uint8_t *buf, size_t length, uint
 	if (strr == _streams.end()) return -1;
 	auto &stream = strr->second;
 	auto &response = stream.response;
-	auto data_avail = response.contentLength - response.data_sent;
-	const char* data = reinterpret_cast<const char*>(response.response_data) + response.data_sent;
 
-	size_t amt = length < data_avail ? length : data_avail;
-	if (amt == 0)
+	// a multipart body is read from its parts one after the other
+	const body_source *parts = &response.body;
+	size_t count = 1;
+	if (!response.parts.empty())
 	{
-		*data_flags = NGHTTP2_DATA_FLAG_EOF;
+		parts = response.parts.data();
+		count = response.parts.size();
 	}
-	else
+
+	size_t amt = 0;
+	size_t skip = response.data_sent;
+	for (size_t i = 0; i < count && amt < length; i++)
 	{
+		auto &part = parts[i];
+		if (skip >= part.size)
+		{
+			skip -= part.size;
+			continue;
+		}
+
 		//*data_flags = NGHTTP2_DATA_FLAG_NO_COPY;
-		memcpy(buf, data, amt);
-		response.data_sent += amt;
+		auto n = std::min(part.size - skip, length - amt);
+		memcpy(buf + amt, part.data + skip, n);
+		amt += n;
+		skip = 0;
+	}
+
+	if (amt == 0)
+	{
+		*data_flags = NGHTTP2_DATA_FLAG_EOF;
 	}
+	response.data_sent += amt;
 
 	return amt;
 }
@@ -7,12 +7,17 @@ class HttpServer
 {
 	using iterator = std::vector<std::shared_ptr<Hosting>>::const_iterator;
 public:
-	HttpServer(std::initializer_list<std::shared_ptr<Hosting>> hostings) :_hostings(hostings) {}
+	// max_pipeline is how many requests an http/1 connection may have waiting for a response
+	// before it is not read from anymore
+	HttpServer(std::initializer_list<std::shared_ptr<Hosting>> hostings, size_t max_pipeline = 16)
+		:_hostings(hostings), _max_pipeline(max_pipeline) {}
 
 	inline iterator begin() const { return _hostings.cbegin(); }
 	inline iterator end() const { return _hostings.cend(); }
+	inline size_t max_pipeline() const { return _max_pipeline; }
 private:
 	std::vector<std::shared_ptr<Hosting>> _hostings;
+	size_t _max_pipeline;
 };
 
 class HttpHandler : public SocketEventReceiver
@@ -31,7 +36,10 @@ protected:
 
 private:
 	HttpParserCallbacks parser_callbacks();
+	void flush();
+	void update_deadline(bool progress);
 
+	void on_message_begin();
 	void on_url(std::string, std::string);
 	void on_status(int, std::string);
 	void on_header(std::string name, std::string value);
@@ -43,21 +51,42 @@ private:
 
 	struct _response
 	{
-		_response(std::vector<char> headers, const char* body, size_t body_size)
-			:headers(headers), body(body), body_size(body_size),
-			headers_written(0), body_written(0)
+		_response(std::vector<char> headers, const body_source &body)
+			:headers(std::move(headers)), body(body), tail_size(0), headers_written(0), body_written(0)
 		{}
 
+		_response(std::shared_ptr<const prepared_headers> prepared, const body_source &body)
+			:prepared(std::move(prepared)), body(body), tail_size(0), headers_written(0), body_written(0)
+		{}
+
+		// the headers go out as the head, serialized for this response or prepared before, and
+		// then the tail with what is different every time
+		inline const char *head() const { return prepared ? prepared->http1.data() : headers.data(); }
+		inline size_t head_size() const { return prepared ? prepared->http1.size() : headers.size(); }
+		inline size_t headers_size() const { return head_size() + tail_size; }
+
+		static constexpr size_t TAIL_MAX = 64;
+
 		std::vector<char> headers;
-		const char* body;
-		size_t body_size;
+		std::shared_ptr<const prepared_headers> prepared;
+		body_source body;
+		char tail[TAIL_MAX];
+		size_t tail_size;
 		size_t headers_written;
 		size_t body_written;
 	};
 
-	std::vector<_response> pending_responses;
+	// responses in the order the requests came in
+	std::deque<_response> pending_responses;
 
 	bool _done;
+	// stopped reading because too many responses are pending
+	bool _throttled;
+	// waiting for the rest of a request. New connections owe us one.
+	bool _in_request;
+	Deadline _deadline;
+	// how much to read at once. Grows for connections that send a lot.
+	size_t _read_size;
 	HttpServer &_http;
 	std::shared_ptr<Socket> _socket;
 	HttpParser _parser;
@@ -74,11 +103,15 @@ public:
 	virtual void write_avail();
 	virtual void closed();
 private:
+	void update_deadline();
+
 	HttpServer &_http;
 	std::shared_ptr<Socket> _socket;
 
 	std::unordered_map<int, request_info> _streams;
 	nghttp2_session *_session;
+	Deadline _deadline;
+	bool _progress;
 
 	ssize_t _recv(uint8_t *buf, size_t length, int flags);
 	ssize_t _send(const uint8_t *data, size_t length, int flags);
@@ -81,6 +81,7 @@ int HttpParser::on_message_begin()
 {
 	_last_value.clear();
 	_last_header.clear();
+	if (_callbacks.message_begin) _callbacks.message_begin();
 
 	return 0;
 }
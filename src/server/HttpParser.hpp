@@ -2,6 +2,7 @@
 
 struct HttpParserCallbacks
 {
+	std::function<void()> message_begin;
 	std::function<void(std::string method, std::string url)> url;
 	std::function<void(int, std::string)> status;
 	std::function<void(std::string name, std::string value)> header;
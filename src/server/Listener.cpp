@@ -1,8 +1,89 @@
 #include "pch.hpp"
 #include "Listener.hpp"
+#include <linux/filter.h>
+#include <poll.h>
+#include <sys/utsname.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+// io_uring sizing per acceptor
+static constexpr unsigned URING_ENTRIES = 1024;
+static constexpr uint16_t URING_BUFFER_COUNT = 1024;
+static constexpr uint32_t URING_BUFFER_SIZE = 4096;
+static constexpr size_t URING_MAX_OUTPUT = 256 * 1024;
+// how long to wait before accepting again after an accept failed, in milliseconds
+static constexpr uint32_t URING_ACCEPT_BACKOFF = 100;
+
+// resolution of connection timeouts in milliseconds
+static constexpr uint32_t TIMER_TICK = 100;
+
+// what counts as much load as one connection when comparing acceptors
+static constexpr uint32_t LOAD_PENDING_BYTES = 64 * 1024;
+static constexpr uint32_t LOAD_LATENCY_US = 100;
 
 // helper funcs
 
+// a monotonic clock in microseconds
+static uint64_t precise_clock()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// the cpus this process may run on, in order
+static std::vector<int> usable_cpus()
+{
+	std::vector<int> result;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+	{
+		for (int i = 0; i < CPU_SETSIZE; i++)
+		{
+			if (CPU_ISSET(i, &set)) result.push_back(i);
+		}
+	}
+	else
+	{
+		logpwarning("sched_getaffinity");
+	}
+
+	return result;
+}
+
+// the number of cpus worth of time the cgroup of this process may use, rounded up.
+// Returns 0 if there is no limit.
+static int cpu_quota()
+{
+	long long quota = -1, period = 0;
+
+	// cgroup v2
+	if (auto f = fopen("/sys/fs/cgroup/cpu.max", "r"))
+	{
+		char max[32];
+		if (fscanf(f, "%31s %lld", max, &period) == 2 && strcmp(max, "max") != 0) quota = atoll(max);
+		fclose(f);
+	}
+	else
+	{
+		// cgroup v1
+		if (auto f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r"))
+		{
+			if (fscanf(f, "%lld", &quota) != 1) quota = -1;
+			fclose(f);
+		}
+		if (auto f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r"))
+		{
+			if (fscanf(f, "%lld", &period) != 1) period = 0;
+			fclose(f);
+		}
+	}
+
+	if (quota <= 0 || period <= 0) return 0;
+	return static_cast<int>((quota + period - 1) / period);
+}
+
 static void write_and_forget(int fd, char* c, size_t l)
 {
 	auto r = write(fd, c, l);
@@ -97,22 +178,97 @@ static int create_and_bind(const char* address, int port)
 	return sfd;
 }
 
-void epoll_add(int efd, int sfd, void* data = nullptr, uint32_t events = EPOLLIN | EPOLLET)
+static int create_listen_socket(const char* address, int port)
 {
-	epoll_event ev{ 0, 0 };
-	ev.events = events;
-	if (data)
+	int sfd = create_and_bind(address, port);
+	try
 	{
-		ev.data.ptr = data;
+		make_non_blocking(sfd);
+		if (listen(sfd, SOMAXCONN) == -1) throw system_err();
 	}
-	else
+	catch (...)
+	{
+		close(sfd);
+		throw;
+	}
+
+	return sfd;
+}
+
+// attaches a classic BPF program to the reuseport group of sfd that picks the socket of the
+// acceptor pinned to the cpu that received the SYN. cpus holds the cpu of each acceptor, and the
+// group sockets are created in the same order. The program is a jump table from cpu to index,
+// since the cpus we may use need not be 0..n-1. SYNs on cpus no acceptor is pinned to, like
+// the ones over the cpu quota, are spread with cpu % n. If the program cannot be attached the
+// kernel hashes instead.
+static void attach_reuseport_steering(int sfd, const std::vector<int> &cpus)
+{
+	std::vector<sock_filter> code;
+	code.push_back({ BPF_LD | BPF_W | BPF_ABS, 0, 0, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU) });
+	for (size_t i = 0; i < cpus.size(); i++)
+	{
+		if (cpus[i] < 0) continue;
+		code.push_back({ BPF_JMP | BPF_JEQ | BPF_K, 0, 1, static_cast<uint32_t>(cpus[i]) });
+		code.push_back({ BPF_RET | BPF_K, 0, 0, static_cast<uint32_t>(i) });
+	}
+	code.push_back({ BPF_ALU | BPF_MOD | BPF_K, 0, 0, static_cast<uint32_t>(cpus.size()) });
+	code.push_back({ BPF_RET | BPF_A, 0, 0, 0 });
+	sock_fprog prog{ static_cast<unsigned short>(code.size()), code.data() };
+
+	if (setsockopt(sfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1)
+	{
+		logpwarning("could not attach reuseport steering program");
+	}
+}
+
+// accepts one pending connection on a listening socket and makes it non-blocking.
+// returns -1 when there are no more connections to accept.
+static int accept_connection(int sfd)
+{
+	sockaddr in_addr;
+	socklen_t in_len = sizeof(sockaddr);
+	auto infd = accept(sfd, &in_addr, &in_len);
+	if (infd == -1)
 	{
-		ev.data.fd = sfd;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			// couldn't accept for some reason
+			logperror("accept");
+		}
+
+		return -1;
+	}
+
+	// get info about the connection
+	char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+	if (!getnameinfo(&in_addr, in_len,
+		hbuf, sizeof hbuf,
+		sbuf, sizeof sbuf,
+		NI_NUMERICHOST | NI_NUMERICSERV))
+	{
+		info("Accepted connection from %s:%s", hbuf, sbuf);
 	}
 
+	// Make the incoming socket non-blocking
+	make_non_blocking(infd);
+	return infd;
+}
+
+void epoll_add(int efd, int sfd, uint64_t data, uint32_t events = EPOLLIN | EPOLLET)
+{
+	epoll_event ev{ 0, 0 };
+	ev.events = events;
+	ev.data.u64 = data;
+
 	if (epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &ev) == -1) throw system_err();
 }
 
+// registers an fd with the fd itself as event data
+void epoll_add(int efd, int sfd)
+{
+	epoll_add(efd, sfd, static_cast<uint64_t>(sfd));
+}
+
 
 // LinuxSocket
 
@@ -123,12 +279,16 @@ LinuxSocket::LinuxSocket(int fd)
 
 ssize_t LinuxSocket::read(void* b, size_t max)
 {
-	if (!b || !max) return 0;
+	if (!b || !max || !_fd) return 0;
 
-	ssize_t r = 0;
-	while (r == 0) r = ::read(_fd, b, max);
+	auto r = ::read(_fd, b, max);
 
-	if (r <= 0)
+	if (r == 0)
+	{
+		// orderly shutdown by the peer
+		return 0;
+	}
+	else if (r < 0)
 	{
 		if (errno == EAGAIN || errno == EWOULDBLOCK)
 		{
@@ -148,7 +308,7 @@ ssize_t LinuxSocket::read(void* b, size_t max)
 
 ssize_t LinuxSocket::write(const void* b, size_t amt)
 {
-	if (!b || !amt) return 0;
+	if (!b || !amt || !_fd) return 0;
 
 	ssize_t r = 0;
 	while (r == 0) r = ::write(_fd, b, amt);
@@ -171,6 +331,53 @@ ssize_t LinuxSocket::write(const void* b, size_t amt)
 	return r;
 }
 
+ssize_t LinuxSocket::writev(const iovec* iov, int iovcnt)
+{
+	if (!iov || iovcnt <= 0 || !_fd) return 0;
+
+	auto r = ::writev(_fd, iov, iovcnt);
+	if (r < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			return -1;
+		}
+		else
+		{
+			// socket broken
+			perror("writev");
+			close();
+			return 0;
+		}
+	}
+
+	return r;
+}
+
+ssize_t LinuxSocket::sendfile(int fd, off_t offset, size_t count)
+{
+	if (fd == -1 || !count || !_fd) return 0;
+
+	auto r = ::sendfile(_fd, fd, &offset, count);
+	if (r < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			return -1;
+		}
+		else
+		{
+			// socket broken
+			perror("sendfile");
+			close();
+			return 0;
+		}
+	}
+
+	// 0 means the file got shorter than what we promised the client
+	return r;
+}
+
 void LinuxSocket::close()
 {
 	if (_fd)
@@ -183,17 +390,42 @@ void LinuxSocket::close()
 
 //Acceptor
 
-Acceptor::Acceptor(int nr)
+Acceptor::Acceptor(int nr, int cpu, EventEngine engine, Timeouts timeouts)
 	: _nr(nr),
+	_cpu(cpu),
 	_efd(epoll_create1(0)),
+	_qfd(eventfd(0, EFD_NONBLOCK)),
+	_tfd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)),
 	_running(true),
-	_thread([this]() { worker(); })
+	_engine(engine),
+	_timeouts(timeouts),
+	_now(coarse_clock()),
+	_timer_armed(false),
+	_connections(0),
+	_pending_bytes(0),
+	_loop_latency(0),
+	_staged(0),
+	_wake_pending(false)
 {
 	if (_efd == -1) throw system_err();
+	if (_qfd == -1) throw system_err();
+	if (_tfd == -1) throw system_err();
 
 	// pipe for signaling
 	if (pipe2(_pfd, O_NONBLOCK) == -1) throw system_err();
 	epoll_add(_efd, _pfd[0]);
+
+	// eventfd for connections handed to us by other threads
+	epoll_add(_efd, _qfd);
+
+	// timerfd that ticks while connections have deadlines
+	epoll_add(_efd, _tfd);
+
+	// other threads hand us work as soon as we are constructed, so wait for the thread to set up
+	std::promise<void> started;
+	auto ready = started.get_future();
+	_thread = std::thread([this, &started]() { worker(started); });
+	ready.wait();
 }
 
 Acceptor::~Acceptor()
@@ -201,213 +433,1075 @@ Acceptor::~Acceptor()
 	stop();
 }
 
-void Acceptor::accept(std::shared_ptr<LinuxSocket> socket, socket_handler acceptHandler)
+bool Acceptor::accept(int fd, const socket_handler *acceptHandler)
 {
-	auto fd = socket->fd();
-	auto events = std::make_shared<Acceptor::LocalSocketEventProducer>();
-	auto pass_socket = std::make_shared< Acceptor::LocalSocket>(socket, *this);
-	acceptHandler(pass_socket, events);
-	_sockets.insert_or_assign(fd, std::make_pair(events, socket));
-	epoll_add(_efd, fd, nullptr, EPOLLIN | EPOLLET | EPOLLOUT | EPOLLHUP | EPOLLRDHUP);
+	// counted before the push so the acceptor can never see it go below zero
+	_connections.fetch_add(1, std::memory_order_relaxed);
+	if (_handoffs->push(handoff{ fd, acceptHandler, HandoffKind::Connection })) return true;
+
+	_connections.fetch_sub(1, std::memory_order_relaxed);
+	return false;
 }
 
-void Acceptor::worker()
+bool Acceptor::listen(int lfd, const socket_handler *acceptHandler)
 {
-	constexpr int n = 1024;
-	epoll_event events[n];
-
-	while (_running)
-	{
-		int numEvents = epoll_wait(_efd, &events[0], n, -1);
-		for (int i = 0; i < numEvents && _running; i++)
-		{
-			const auto &event = events[i];
-			auto sfd = event.data.fd;
-
-			// if data from _pfd then quit
-			if (sfd == _pfd[0]) break;
+	return _handoffs->push(handoff{ lfd, acceptHandler, HandoffKind::Listen });
+}
 
-			auto handleriterator = _sockets.find(sfd);
-			if (handleriterator == _sockets.end())
-			{
-				// we got notified for a socket we don't have for some reason.
-				continue;
-			}
+bool Acceptor::unlisten(int lfd)
+{
+	return _handoffs->push(handoff{ lfd, nullptr, HandoffKind::Unlisten });
+}
 
-			auto eventReceiver = handleriterator->second.first;
-			bool eof = false;
-			auto eventFlags = event.events;
+uint32_t Acceptor::load() const
+{
+	return _connections.load(std::memory_order_relaxed) +
+		_pending_bytes.load(std::memory_order_relaxed) / LOAD_PENDING_BYTES +
+		_loop_latency.load(std::memory_order_relaxed) / LOAD_LATENCY_US;
+}
 
+void Acceptor::publish_load(uint64_t busy)
+{
+	// a moving average over roughly the last 8 iterations. The loop sleeps when there is nothing to
+	// do, so without connections the last value would stick around.
+	uint32_t latency = 0;
+	if (_connections.load(std::memory_order_relaxed) > 0)
+	{
+		latency = _loop_latency.load(std::memory_order_relaxed);
+		latency = static_cast<uint32_t>((latency * 7 + std::min<uint64_t>(busy, UINT32_MAX)) / 8);
+	}
+	_loop_latency.store(latency, std::memory_order_relaxed);
+	_pending_bytes.store(static_cast<uint32_t>(std::min<size_t>(_staged, UINT32_MAX)), std::memory_order_relaxed);
+}
 
-			if (eventFlags & (EPOLLPRI | EPOLLERR | EPOLLHUP | EPOLLRDHUP))
-			{
-				eof = true;
-			}
-			else
-			{
-				try
-				{
-					if (eventFlags & EPOLLIN)
-					{
-						eventReceiver->signal_read_avail();
-					}
+void Acceptor::notify()
+{
+	if (!_wake_pending.exchange(true, std::memory_order_acq_rel))
+	{
+		uint64_t one = 1;
+		write_and_forget(_qfd, reinterpret_cast<char*>(&one), sizeof(one));
+	}
+}
 
-					if (eventFlags & EPOLLOUT)
-					{
-						eventReceiver->signal_write_avail();
-					}
-				}
-				catch (std::runtime_error &e)
-				{
-					error("Exception in handler: %s\n", e.what());
-					eof = true;
-				}
-				catch (...)
-				{
-					error("Unknown exception in handler\n");
-					eof = true;
-				}
-			}
+void Acceptor::take_handoffs()
+{
+	uint64_t count;
+	auto r = ::read(_qfd, &count, sizeof(count));
+	(void)r;
 
-			if (eof)
-			{
-				try
-				{
-					handleriterator->second.second->close();
-					eventReceiver->signal_closed();
-				}
-				catch (...) {}
+	// anything pushed before a producer saw the flag set is visible after clearing it
+	_wake_pending.exchange(false, std::memory_order_acq_rel);
 
-				_sockets.erase(handleriterator);
-			}
+	handoff h;
+	while (_handoffs->pop(h))
+	{
+		try
+		{
+			if (h.kind == HandoffKind::Listen) add_listener(h.fd, h.acceptHandler);
+			else if (h.kind == HandoffKind::Unlisten) remove_listener(h.fd);
+			else if (_engine == EventEngine::IoUring) uring_accept(h.fd, *h.acceptHandler);
+			else add_socket(h.fd, *h.acceptHandler);
+		}
+		catch (std::runtime_error &e)
+		{
+			error("could not accept connection: %s\n", e.what());
 		}
 	}
+
+	take_wakeups();
 }
 
-void Acceptor::stop()
+// the connection may be gone by the time this gets to it, in which case its key finds nothing
+bool Acceptor::wake(uint64_t key)
 {
-	_running = false;
+	if (!_wakeups->push(key)) return false;
+	notify();
+	return true;
+}
 
-	if (_pfd[1]) { char a = 0; write_and_forget(_pfd[1], &a, 1); }
+void Acceptor::take_wakeups()
+{
+	uint64_t key;
+	while (_wakeups->pop(key))
+	{
+		LocalSocketEventProducer *events = nullptr;
+		if (_engine == EventEngine::IoUring)
+		{
+			auto conn = _uring_sockets.find(key);
+			if (conn && conn->socket->_fd != -1) events = conn->events.get();
+		}
+		else
+		{
+			auto conn = _sockets.find(key);
+			if (conn) events = conn->events.get();
+		}
+		if (!events) continue;
 
-	if (_thread.joinable()) _thread.join();
+		bool eof = false;
+		try
+		{
+			events->signal_read_avail();
+		}
+		catch (std::runtime_error &e)
+		{
+			error("Exception in handler: %s\n", e.what());
+			eof = true;
+		}
+		catch (...)
+		{
+			error("Unknown exception in handler\n");
+			eof = true;
+		}
 
-	if (_efd) { close(_efd); _efd = 0; }
-	if (_pfd[0]) { close(_pfd[0]); _pfd[0] = 0; }
-	if (_pfd[1]) { close(_pfd[1]); _pfd[1] = 0; }
+		if (eof) expire(key);
+	}
 }
 
+void Acceptor::add_listener(int lfd, const socket_handler *acceptHandler)
+{
+	_listeners.push_back(listen_socket{ lfd, acceptHandler });
+	if (_engine == EventEngine::IoUring) uring_arm_accept(_listeners.size() - 1);
+	else epoll_add(_efd, lfd);
+}
 
-// Listener
-
-Listener::Listener(const char* address, int port, socket_handler acceptHandler)
-	: _efd(initialize_epoll()),
-	_sfd(initialize_socket(address, port)),
-	_thread([this]() {worker(); }),
-	_acceptors(initialize_acceptors()),
-	_acceptHandler(acceptHandler)
+// the socket stays in the list, closed, so io_uring completions can still find theirs by index
+void Acceptor::remove_listener(int lfd)
 {
-	if (_efd == -1) throw system_err();
+	for (size_t i = 0; i < _listeners.size(); i++)
+	{
+		auto &ls = _listeners[i];
+		if (ls.fd != lfd) continue;
 
-	// pipe for signaling
-	if (pipe2(_pfd, O_NONBLOCK) == -1) throw system_err();
-	epoll_add(_efd, _pfd[0]);
+		if (_engine == EventEngine::IoUring)
+		{
+			auto sqe = uring_sqe(UringOp::Cancel);
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = (static_cast<uint64_t>(i) << 8) | static_cast<uint8_t>(UringOp::Accept);
+		}
+		else if (epoll_ctl(_efd, EPOLL_CTL_DEL, lfd, nullptr) == -1)
+		{
+			logpwarning("epoll_ctl");
+		}
 
-	info("listening on %s:%d\n", address ? address : "0.0.0.0", port);
+		close(lfd);
+		ls.fd = -1;
+	}
 }
 
-Listener::~Listener()
+void Acceptor::add_socket(int fd, const socket_handler &acceptHandler)
 {
-	stop();
-	wait();
-}
+	auto socket = std::make_shared<LinuxSocket>(fd);
+	auto events = std::make_shared<Acceptor::LocalSocketEventProducer>();
+	auto key = _sockets.insert(connection{ events, socket });
+	auto pass_socket = std::make_shared< Acceptor::LocalSocket>(socket, key, *this);
 
-int Listener::initialize_epoll()
-{
-	int efd = epoll_create1(0);
-	if (efd == -1) throw system_err();
-	return efd;
+	try
+	{
+		_sockets.find(key)->timer.data = key;
+		set_deadline(key, Deadline::Header);
+		acceptHandler(pass_socket, events);
+		epoll_add(_efd, fd, key, EPOLLIN | EPOLLET | EPOLLOUT | EPOLLHUP | EPOLLRDHUP);
+	}
+	catch (...)
+	{
+		socket->close();
+		_sockets.erase(key);
+		_connections.fetch_sub(1, std::memory_order_relaxed);
+		throw;
+	}
 }
 
-int Listener::initialize_socket(const char* address, int port)
+void Acceptor::retire(uint64_t key)
 {
-	int sfd = create_and_bind(address, port);
-	make_non_blocking(sfd);
-	if (listen(sfd, SOMAXCONN) == -1) throw system_err();
-	epoll_add(_efd, sfd);
-	return sfd;
+	auto conn = _sockets.find(key);
+	if (!conn) return;
+
+	conn->timer.cancel();
+	_sockets.retire(key);
+	_closed.push_back(key);
+	_connections.fetch_sub(1, std::memory_order_relaxed);
 }
 
-std::vector<Acceptor> Listener::initialize_acceptors()
+void Acceptor::set_deadline(uint64_t key, Deadline deadline)
 {
-	int n = std::thread::hardware_concurrency();
-	if (n <= 0) n = 1;
-	std::vector<Acceptor> result;
-	result.reserve(n);
-	for (int i = 0; i < n; i++)
+	TimerWheel::Timer *timer = nullptr;
+	if (_engine == EventEngine::IoUring)
 	{
-		result.emplace_back(i);
+		auto conn = _uring_sockets.find(key);
+		if (conn) timer = &conn->timer;
 	}
+	else
+	{
+		auto conn = _sockets.find(key);
+		if (conn) timer = &conn->timer;
+	}
+	if (!timer) return;
 
-	return result;
+	uint32_t timeout = 0;
+	switch (deadline)
+	{
+	case Deadline::Idle: timeout = _timeouts.idle; break;
+	case Deadline::Header: timeout = _timeouts.header; break;
+	case Deadline::Write: timeout = _timeouts.write; break;
+	default: break;
+	}
+
+	if (timeout) _timers->schedule(*timer, _now + timeout);
+	else timer->cancel();
 }
 
-void Listener::worker()
+void Acceptor::run_timers()
 {
-	constexpr int n = 1024;
-	epoll_event events[n];
+	_timers->advance(_now, [this](TimerWheel::Timer &timer) { expire(timer.data); });
 
-	while (_running)
+	// only tick while something can expire
+	bool armed = _timers->size() > 0;
+	if (armed != _timer_armed)
 	{
-		auto numEvents = epoll_wait(_efd, &events[0], n, -1);
-		for (int i = 0; i < numEvents && _running; i++)
+		itimerspec spec;
+		memset(&spec, 0, sizeof(spec));
+		if (armed)
 		{
-			const auto &event = events[i];
-			const auto sfd = event.data.fd;
-			auto eventFlags = event.events;
+			spec.it_interval.tv_nsec = TIMER_TICK * 1000000L;
+			spec.it_value = spec.it_interval;
+		}
+		if (timerfd_settime(_tfd, 0, &spec, nullptr) == -1) logperror("timerfd_settime");
+		_timer_armed = armed;
+	}
+}
 
-			// if data from _pfd then quit
-			if (sfd == _pfd[0]) break;
+void Acceptor::expire(uint64_t key)
+{
+	if (_engine == EventEngine::IoUring)
+	{
+		auto conn = _uring_sockets.find(key);
+		if (conn) uring_eof(*conn->events, *conn->socket);
+		return;
+	}
 
-			if (eventFlags & EPOLLIN)
+	auto conn = _sockets.find(key);
+	if (!conn) return;
+
+	try
+	{
+		conn->socket->close();
+		conn->events->signal_closed();
+	}
+	catch (...) {}
+
+	retire(key);
+}
+
+// whether the kernel has what the loop uses. The probe only knows operations, not their flags.
+// Multishot recv came last, with linux 6.0, and kernels before it fail every recv asking for it.
+static void uring_check(const Uring &ring)
+{
+	for (auto op : { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_POLL_ADD, IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL })
+	{
+		if (!ring.supports(op)) throw std::runtime_error("io_uring is missing an operation");
+	}
+
+	utsname name;
+	int major = 0, minor = 0;
+	if (uname(&name) == -1 || sscanf(name.release, "%d.%d", &major, &minor) != 2 || major < 6)
+	{
+		throw std::runtime_error("io_uring has no multishot recv before linux 6.0");
+	}
+}
+
+void Acceptor::worker(std::promise<void> &started)
+{
+	// pin before allocating anything, and have what this thread allocates come from the numa node
+	// of the cpu it runs on
+	if (_cpu >= 0)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(_cpu, &set);
+		auto r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (r != 0)
+		{
+			errno = r;
+			logpwarning("pthread_setaffinity_np");
+		}
+
+		// kernels without numa support don't have it, and don't need it
+		if (syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0) == -1 && errno != ENOSYS)
+		{
+			logpwarning("set_mempolicy");
+		}
+	}
+
+	_timers = std::make_unique<TimerWheel>(TIMER_TICK, _now);
+	_handoffs = std::make_unique<MpscQueue<handoff, 4096>>();
+	_wakeups = std::make_unique<MpscQueue<uint64_t, 4096>>();
+	started.set_value();
+
+	if (_engine == EventEngine::IoUring)
+	{
+		try
+		{
+			_ring = std::make_unique<Uring>(URING_ENTRIES);
+			uring_check(*_ring);
+			_buffers = std::make_unique<UringBufferRing>(*_ring, 0, URING_BUFFER_COUNT, URING_BUFFER_SIZE);
+		}
+		catch (std::exception &e)
+		{
+			warning("acceptor %d: io_uring not available (%s), falling back to epoll", _nr, e.what());
+			_buffers.reset();
+			_ring.reset();
+			_engine = EventEngine::Epoll;
+		}
+	}
+
+	if (_engine == EventEngine::IoUring) uring_worker();
+	else epoll_worker();
+}
+
+void Acceptor::epoll_worker()
+{
+	constexpr int n = 1024;
+	epoll_event events[n];
+
+	while (_running)
+	{
+		int numEvents = epoll_wait(_efd, &events[0], n, -1);
+		auto start = precise_clock();
+		_now = coarse_clock();
+		for (int i = 0; i < numEvents && _running; i++)
+		{
+			const auto &event = events[i];
+			auto key = event.data.u64;
+
+			// our own fds are registered by number, which never collides with a slab key
+
+			// if data from _pfd then quit
+			if (key == static_cast<uint64_t>(_pfd[0])) break;
+
+			// connections handed to us by another thread
+			if (key == static_cast<uint64_t>(_qfd))
+			{
+				take_handoffs();
+				continue;
+			}
+
+			// timers run after the batch
+			if (key == static_cast<uint64_t>(_tfd))
 			{
-				while (1)
+				uint64_t ticks;
+				auto r = ::read(_tfd, &ticks, sizeof(ticks));
+				(void)r;
+				continue;
+			}
+
+			// whatever else is not a slab key is one of our listening sockets
+			if (key < (1ull << Slab<connection>::INDEX_BITS))
+			{
+				for (auto &ls : _listeners)
+				{
+					if (key == static_cast<uint64_t>(ls.fd)) accept_all(ls);
+				}
+				continue;
+			}
+
+			auto conn = _sockets.find(key);
+			if (!conn)
+			{
+				// the connection was closed earlier in this batch
+				continue;
+			}
+
+			auto &eventReceiver = *conn->events;
+			bool eof = false;
+			auto eventFlags = event.events;
+
+
+			if (eventFlags & (EPOLLPRI | EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+			{
+				eof = true;
+			}
+			else
+			{
+				try
 				{
-					sockaddr in_addr;
-					socklen_t in_len = sizeof(sockaddr);
-					auto infd = accept(sfd, &in_addr, &in_len);
-					if (infd == -1)
+					if (eventFlags & EPOLLIN)
 					{
-						if ((errno == EAGAIN) ||
-							(errno == EWOULDBLOCK))
-						{
-							// We have processed all incoming connections.
-							break;
-						}
-						else
-						{
-							// couldn't accept for some reason
-							logperror("accept");
-							break;
-						}
+						eventReceiver.signal_read_avail();
 					}
 
-					// get info about the connection
-					char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
-					if (!getnameinfo(&in_addr, in_len,
-						hbuf, sizeof hbuf,
-						sbuf, sizeof sbuf,
-						NI_NUMERICHOST | NI_NUMERICSERV))
+					if (eventFlags & EPOLLOUT)
 					{
-						info("Accepted connection from %s:%s", hbuf, sbuf);
+						eventReceiver.signal_write_avail();
 					}
+				}
+				catch (std::runtime_error &e)
+				{
+					error("Exception in handler: %s\n", e.what());
+					eof = true;
+				}
+				catch (...)
+				{
+					error("Unknown exception in handler\n");
+					eof = true;
+				}
+			}
 
-					// Make the incoming socket non-blocking and forward to an acceptor
-					make_non_blocking(infd);
+			if (eof) expire(key);
+		}
 
-					auto socket = std::make_shared<LinuxSocket>(infd);
-					auto& acceptor = _acceptors[_counter++ % _acceptors.size()];
-					acceptor.accept(socket, _acceptHandler);
+		run_timers();
+
+		// nothing refers to the connections closed in this batch anymore
+		for (auto closed : _closed) _sockets.release(closed);
+		_closed.clear();
+
+		publish_load(precise_clock() - start);
+	}
+}
+
+void Acceptor::accept_all(const listen_socket &ls)
+{
+	for (;;)
+	{
+		auto infd = accept_connection(ls.fd);
+		if (infd == -1) break;
+		_connections.fetch_add(1, std::memory_order_relaxed);
+
+		try
+		{
+			add_socket(infd, *ls.acceptHandler);
+		}
+		catch (std::runtime_error &e)
+		{
+			error("could not accept connection: %s\n", e.what());
+		}
+	}
+}
+
+void Acceptor::stop()
+{
+	_running = false;
+
+	if (_pfd[1]) { char a = 0; write_and_forget(_pfd[1], &a, 1); }
+
+	if (_thread.joinable()) _thread.join();
+
+	// connections nobody picked up
+	handoff h;
+	while (_handoffs->pop(h)) if (h.kind != HandoffKind::Unlisten) close(h.fd);
+
+	// connections retire themselves as they are destroyed so the list is cleared last
+	_sockets.clear();
+	_closed.clear();
+
+	// closing io_uring sockets after the loop stopped does not submit anything
+	_uring_sockets.clear();
+	_buffers.reset();
+	_ring.reset();
+
+	for (auto &ls : _listeners) if (ls.fd != -1) close(ls.fd);
+	_listeners.clear();
+	if (_qfd >= 0) { close(_qfd); _qfd = -1; }
+	if (_tfd >= 0) { close(_tfd); _tfd = -1; }
+	if (_efd) { close(_efd); _efd = 0; }
+	if (_pfd[0]) { close(_pfd[0]); _pfd[0] = 0; }
+	if (_pfd[1]) { close(_pfd[1]); _pfd[1] = 0; }
+}
+
+
+// Acceptor io_uring engine
+
+io_uring_sqe *Acceptor::uring_sqe(UringOp op, uint64_t id)
+{
+	auto sqe = _ring->get_sqe();
+	sqe->user_data = (static_cast<uint64_t>(id) << 8) | static_cast<uint8_t>(op);
+	return sqe;
+}
+
+void Acceptor::uring_worker()
+{
+	// wake up when stopped
+	auto sqe = uring_sqe(UringOp::Stop);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = _pfd[0];
+	sqe->poll32_events = POLLIN;
+
+	uring_arm_handoff();
+	uring_arm_timer();
+
+	while (_running)
+	{
+		// one syscall submits everything queued during the last pass and waits for more work
+		_ring->submit_and_wait(1);
+		auto start = precise_clock();
+		_now = coarse_clock();
+		_ring->for_each_cqe([this](const io_uring_cqe &cqe) { if (_running) uring_complete(cqe); });
+		if (_running) run_timers();
+		_buffers->publish();
+		uring_flush();
+		publish_load(precise_clock() - start);
+	}
+}
+
+void Acceptor::uring_complete(const io_uring_cqe &cqe)
+{
+	auto op = static_cast<UringOp>(cqe.user_data & 0xff);
+	auto id = cqe.user_data >> 8;
+
+	switch (op)
+	{
+	case UringOp::Stop:
+		_running = false;
+		return;
+
+	case UringOp::Accept:
+		// accepts carry the index of the listening socket
+		if (cqe.res >= 0)
+		{
+			_connections.fetch_add(1, std::memory_order_relaxed);
+			uring_accept(cqe.res, *_listeners[id].acceptHandler);
+		}
+		else if (_listeners[id].fd != -1)
+		{
+			errno = -cqe.res;
+			logperror("accept");
+
+			// errors like EMFILE end the multishot accept and would fail again right away.
+			// Give connections some time to close before accepting again.
+			if (!(cqe.flags & IORING_CQE_F_MORE))
+			{
+				uring_arm_backoff(id);
+				return;
+			}
+		}
+
+		// the kernel stopped the multishot accept. Restart it, unless the socket was removed.
+		if (!(cqe.flags & IORING_CQE_F_MORE) && _listeners[id].fd != -1) uring_arm_accept(id);
+		return;
+
+	case UringOp::Backoff:
+		if (_listeners[id].fd != -1) uring_arm_accept(id);
+		return;
+
+	case UringOp::Handoff:
+		take_handoffs();
+		if (!(cqe.flags & IORING_CQE_F_MORE)) uring_arm_handoff();
+		return;
+
+	case UringOp::Timer:
+	{
+		// timers run after the pass
+		uint64_t ticks;
+		auto r = ::read(_tfd, &ticks, sizeof(ticks));
+		(void)r;
+		if (!(cqe.flags & IORING_CQE_F_MORE)) uring_arm_timer();
+		return;
+	}
+
+	case UringOp::Cancel:
+		return;
+
+	default:
+		break;
+	}
+
+	// sockets are only erased between passes so these stay valid while dispatching
+	auto conn = _uring_sockets.find(id);
+	if (!conn)
+	{
+		// a completion for a socket that is gone. Give back any buffer it took.
+		if (cqe.flags & IORING_CQE_F_BUFFER) _buffers->recycle(static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+		return;
+	}
+
+	auto &events = *conn->events;
+	auto &socket = *conn->socket;
+
+	if (op == UringOp::Recv) uring_received(events, socket, cqe);
+	else if (op == UringOp::Send) uring_sent(events, socket, cqe);
+
+	if (socket._fd == -1 && socket._inflight == 0)
+	{
+		_uring_closed.push_back(id);
+	}
+}
+
+void Acceptor::uring_arm_handoff()
+{
+	auto sqe = uring_sqe(UringOp::Handoff);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = _qfd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+void Acceptor::uring_arm_timer()
+{
+	auto sqe = uring_sqe(UringOp::Timer);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = _tfd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+void Acceptor::uring_arm_accept(size_t index)
+{
+	auto sqe = uring_sqe(UringOp::Accept, index);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = _listeners[index].fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK;
+}
+
+void Acceptor::uring_arm_backoff(size_t index)
+{
+	// read when the ring is submitted, so it can't live on the stack
+	static const __kernel_timespec backoff{ 0, URING_ACCEPT_BACKOFF * 1000000L };
+
+	auto sqe = uring_sqe(UringOp::Backoff, index);
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = reinterpret_cast<uint64_t>(&backoff);
+	sqe->len = 1;
+}
+
+void Acceptor::uring_accept(int fd, const socket_handler &acceptHandler)
+{
+	auto events = std::make_shared<Acceptor::LocalSocketEventProducer>();
+	auto id = _uring_sockets.insert(uring_connection{ events, nullptr });
+	auto socket = std::make_shared<UringSocket>(fd, id, *this);
+	auto conn = _uring_sockets.find(id);
+	conn->socket = socket;
+	conn->timer.data = id;
+	set_deadline(id, Deadline::Header);
+
+	try
+	{
+		acceptHandler(socket, events);
+	}
+	catch (std::runtime_error &e)
+	{
+		error("could not accept connection: %s\n", e.what());
+		socket->close();
+		return;
+	}
+
+	// the receive is armed at the end of this pass
+	uring_queue(*socket);
+}
+
+void Acceptor::uring_received(LocalSocketEventProducer &events, UringSocket &socket, const io_uring_cqe &cqe)
+{
+	if (!(cqe.flags & IORING_CQE_F_MORE))
+	{
+		socket._recv_armed = false;
+		socket._inflight--;
+	}
+
+	if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER))
+	{
+		auto bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+		if (socket._fd != -1)
+		{
+			socket._recv_data = _buffers->buffer(bid);
+			socket._recv_left = cqe.res;
+
+			bool eof = false;
+			try
+			{
+				events.signal_read_avail();
+				if (socket._output.size() < URING_MAX_OUTPUT) events.signal_write_avail();
+			}
+			catch (std::runtime_error &e)
+			{
+				error("Exception in handler: %s\n", e.what());
+				eof = true;
+			}
+			catch (...)
+			{
+				error("Unknown exception in handler\n");
+				eof = true;
+			}
+
+			// keep what the receiver did not read so the buffer can go back to the kernel
+			if (socket._recv_left > 0 && socket._fd != -1)
+			{
+				socket._input.insert(socket._input.end(), socket._recv_data, socket._recv_data + socket._recv_left);
+			}
+			socket._recv_data = nullptr;
+			socket._recv_left = 0;
+
+			if (eof) uring_eof(events, socket);
+		}
+
+		_buffers->recycle(bid);
+	}
+	else if (cqe.res == 0)
+	{
+		// orderly shutdown by the peer
+		socket._eof = true;
+		uring_eof(events, socket);
+	}
+	else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED)
+	{
+		// socket broken
+		uring_eof(events, socket);
+	}
+
+	// re-arm the receive if the kernel stopped it, typically because it ran out of buffers
+	if (!socket._recv_armed) uring_queue(socket);
+}
+
+void Acceptor::uring_sent(LocalSocketEventProducer &events, UringSocket &socket, const io_uring_cqe &cqe)
+{
+	socket._send_armed = false;
+	socket._inflight--;
+
+	if (cqe.res < 0)
+	{
+		uring_eof(events, socket);
+		return;
+	}
+
+	// a closed socket gave up its staged bytes when it was closed
+	socket._sent += cqe.res;
+	if (socket._fd != -1) _staged -= cqe.res;
+	if (socket._sent >= socket._sending.size())
+	{
+		socket._sending.clear();
+		socket._sent = 0;
+	}
+
+	// send the remainder or whatever was written in the meantime
+	uring_queue(socket);
+
+	if (socket._fd != -1 && socket._output.size() < URING_MAX_OUTPUT)
+	{
+		try
+		{
+			events.signal_write_avail();
+		}
+		catch (std::runtime_error &e)
+		{
+			error("Exception in handler: %s\n", e.what());
+			uring_eof(events, socket);
+		}
+		catch (...)
+		{
+			error("Unknown exception in handler\n");
+			uring_eof(events, socket);
+		}
+	}
+}
+
+void Acceptor::uring_eof(LocalSocketEventProducer &events, UringSocket &socket)
+{
+	if (socket._fd == -1) return;
+
+	try
+	{
+		socket.close();
+		events.signal_closed();
+	}
+	catch (...) {}
+}
+
+void Acceptor::uring_queue(UringSocket &socket)
+{
+	if (!socket._queued && socket._fd != -1)
+	{
+		socket._queued = true;
+		_uring_queued.push_back(socket._id);
+	}
+}
+
+void Acceptor::uring_flush()
+{
+	for (auto id : _uring_queued)
+	{
+		auto conn = _uring_sockets.find(id);
+		if (!conn) continue;
+
+		auto &socket = *conn->socket;
+		socket._queued = false;
+		if (socket._fd == -1) continue;
+
+		if (!socket._recv_armed && !socket._eof)
+		{
+			auto sqe = uring_sqe(UringOp::Recv, id);
+			sqe->opcode = IORING_OP_RECV;
+			sqe->fd = socket._fd;
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = _buffers->group();
+			socket._recv_armed = true;
+			socket._inflight++;
+		}
+
+		if (!socket._send_armed)
+		{
+			if (socket._sending.empty() && !socket._output.empty())
+			{
+				std::swap(socket._sending, socket._output);
+				socket._sent = 0;
+			}
+
+			if (socket._sent < socket._sending.size())
+			{
+				auto sqe = uring_sqe(UringOp::Send, id);
+				sqe->opcode = IORING_OP_SEND;
+				sqe->fd = socket._fd;
+				sqe->addr = reinterpret_cast<uint64_t>(&socket._sending[socket._sent]);
+				sqe->len = static_cast<uint32_t>(socket._sending.size() - socket._sent);
+				sqe->msg_flags = MSG_NOSIGNAL;
+				socket._send_armed = true;
+				socket._inflight++;
+			}
+		}
+	}
+	_uring_queued.clear();
+
+	// sockets can only go once the kernel is done with their buffers
+	for (size_t i = 0; i < _uring_closed.size(); i++)
+	{
+		auto conn = _uring_sockets.find(_uring_closed[i]);
+		if (conn && conn->socket->_fd == -1 && conn->socket->_inflight == 0)
+		{
+			_uring_sockets.erase(_uring_closed[i]);
+		}
+	}
+	_uring_closed.clear();
+}
+
+void Acceptor::uring_close(UringSocket &socket)
+{
+	if (socket._recv_armed && _running)
+	{
+		auto sqe = uring_sqe(UringOp::Cancel);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (static_cast<uint64_t>(socket._id) << 8) | static_cast<uint8_t>(UringOp::Recv);
+	}
+
+	auto conn = _uring_sockets.find(socket._id);
+	if (conn) conn->timer.cancel();
+
+	::close(socket._fd);
+	socket._fd = -1;
+	_staged -= socket._output.size() + socket._sending.size() - socket._sent;
+	socket._output.clear();
+	_uring_closed.push_back(socket._id);
+	_connections.fetch_sub(1, std::memory_order_relaxed);
+}
+
+
+// Acceptor::UringSocket
+
+ssize_t Acceptor::UringSocket::read(void* b, size_t max)
+{
+	if (!b || !max || _fd == -1) return 0;
+
+	auto p = static_cast<char*>(b);
+	size_t amt = 0;
+
+	// leftovers first to keep the stream in order
+	if (_input_read < _input.size())
+	{
+		amt = std::min(max, _input.size() - _input_read);
+		memcpy(p, &_input[_input_read], amt);
+		_input_read += amt;
+		if (_input_read == _input.size())
+		{
+			_input.clear();
+			_input_read = 0;
+		}
+	}
+
+	if (amt < max && _recv_left > 0)
+	{
+		auto n = std::min(max - amt, _recv_left);
+		memcpy(p + amt, _recv_data, n);
+		_recv_data += n;
+		_recv_left -= n;
+		amt += n;
+	}
+
+	if (amt == 0) return _eof ? 0 : -1;
+	return amt;
+}
+
+ssize_t Acceptor::UringSocket::write(const void* b, size_t amt)
+{
+	if (!b || !amt || _fd == -1) return 0;
+
+	if (_output.size() >= URING_MAX_OUTPUT) return -1;
+
+	auto n = std::min(amt, URING_MAX_OUTPUT - _output.size());
+	auto p = static_cast<const char*>(b);
+	_output.insert(_output.end(), p, p + n);
+	_acceptor._staged += n;
+	_acceptor.uring_queue(*this);
+	return n;
+}
+
+void Acceptor::UringSocket::close()
+{
+	if (_fd == -1) return;
+	_acceptor.uring_close(*this);
+}
+
+
+// AcceptorPool
+
+AcceptorPool::AcceptorPool(EventEngine engine, Timeouts timeouts)
+	: _acceptors(initialize_acceptors(engine, timeouts))
+{
+}
+
+AcceptorPool::~AcceptorPool()
+{
+	stop();
+}
+
+const socket_handler *AcceptorPool::add_handler(socket_handler acceptHandler)
+{
+	_handlers.push_back(std::make_unique<socket_handler>(acceptHandler));
+	return _handlers.back().get();
+}
+
+void AcceptorPool::stop()
+{
+	for (auto &acceptor : _acceptors) acceptor.stop();
+}
+
+std::vector<Acceptor> AcceptorPool::initialize_acceptors(EventEngine engine, Timeouts timeouts)
+{
+	auto cpus = usable_cpus();
+	size_t n = cpus.size();
+
+	// no point in running more threads than the cpu quota lets us use at once
+	auto quota = cpu_quota();
+	if (quota > 0 && static_cast<size_t>(quota) < n) n = quota;
+	if (n == 0) n = 1;
+
+	std::vector<Acceptor> result;
+	result.reserve(n);
+	for (size_t i = 0; i < n; i++)
+	{
+		result.emplace_back(static_cast<int>(i), i < cpus.size() ? cpus[i] : -1, engine, timeouts);
+	}
+
+	info("%zu acceptors for %zu cpus%s\n", n, cpus.size(), quota > 0 ? " (limited by cpu quota)" : "");
+	return result;
+}
+
+
+// Listener
+
+Listener::Listener(AcceptorPool &pool, const char* address, int port, socket_handler acceptHandler, ListenMode mode, DispatchPolicy dispatch)
+	: _port(port),
+	_efd(initialize_epoll()),
+	_sfd(mode == ListenMode::Single ? initialize_socket(address, port) : -1),
+	_counter(0),
+	_random(static_cast<uint32_t>(port) * 2654435761u | 1),
+	_dispatch(dispatch),
+	_pool(pool),
+	_acceptHandler(pool.add_handler(acceptHandler))
+{
+	if (mode == ListenMode::ReusePort) initialize_reuseport(address, port);
+
+	// pipe for signaling
+	if (pipe2(_pfd, O_NONBLOCK) == -1) throw system_err();
+	epoll_add(_efd, _pfd[0]);
+
+	// in reuseport mode the acceptors accept by themselves and this thread only waits to be stopped
+	_thread = std::thread([this]() {worker(); });
+
+	info("listening on %s:%d%s\n", address ? address : "0.0.0.0", port, mode == ListenMode::ReusePort ? " (reuseport)" : "");
+}
+
+Listener::~Listener()
+{
+	stop();
+	wait();
+}
+
+int Listener::initialize_epoll()
+{
+	int efd = epoll_create1(0);
+	if (efd == -1) throw system_err();
+	return efd;
+}
+
+int Listener::initialize_socket(const char* address, int port)
+{
+	int sfd = create_listen_socket(address, port);
+	epoll_add(_efd, sfd);
+	return sfd;
+}
+
+void Listener::initialize_reuseport(const char* address, int port)
+{
+	// every socket joins the same reuseport group, in acceptor order
+	for (size_t i = 0; i < _pool.size(); i++)
+	{
+		int lfd = create_listen_socket(address, port);
+		if (i == 0)
+		{
+			std::vector<int> cpus;
+			for (auto &acceptor : _pool) cpus.push_back(acceptor.cpu());
+			attach_reuseport_steering(lfd, cpus);
+		}
+
+		auto &acceptor = _pool[i];
+		if (!acceptor.listen(lfd, _acceptHandler))
+		{
+			close(lfd);
+			throw std::runtime_error("acceptor queue full");
+		}
+		_reuseport_fds.push_back(lfd);
+		acceptor.notify();
+	}
+}
+
+void Listener::worker()
+{
+	constexpr int n = 1024;
+	epoll_event events[n];
+
+	while (_running)
+	{
+		auto numEvents = epoll_wait(_efd, &events[0], n, -1);
+		for (int i = 0; i < numEvents && _running; i++)
+		{
+			const auto &event = events[i];
+			const auto sfd = event.data.fd;
+			auto eventFlags = event.events;
+
+			// if data from _pfd then quit
+			if (sfd == _pfd[0]) break;
+
+			if (eventFlags & EPOLLIN)
+			{
+				for (;;)
+				{
+					auto infd = accept_connection(sfd);
+					if (infd == -1) break;
+
+					// forward to an acceptor, moving on to the next if it is backed up
+					bool queued = false;
+					auto first = pick_acceptor();
+					for (size_t tries = 0; tries < _pool.size() && !queued; tries++)
+					{
+						auto& acceptor = _pool[(first + tries) % _pool.size()];
+						queued = acceptor.accept(infd, _acceptHandler);
+						if (queued) acceptor.notify();
+					}
+
+					if (!queued)
+					{
+						warning("all acceptors are backed up. dropping connection");
+						close(infd);
+					}
 				}
 			}
 			else
@@ -418,12 +1512,64 @@ void Listener::worker()
 		}
 	}
 
+	// the acceptors stop accepting on their reuseport sockets and close them. They run until
+	// after the listeners stopped, so their queues empty out.
+	for (size_t i = 0; i < _reuseport_fds.size(); i++)
+	{
+		auto &acceptor = _pool[i];
+		while (!acceptor.unlisten(_reuseport_fds[i])) std::this_thread::yield();
+		acceptor.notify();
+	}
+	_reuseport_fds.clear();
+
 	if (_sfd > 0) { close(_sfd); _sfd = 0; }
 	if (_efd > 0) { close(_efd); _efd = 0; }
 	if (_pfd[0]) { close(_pfd[0]); _pfd[0] = 0; }
 	if (_pfd[1]) { close(_pfd[1]); _pfd[1] = 0; }
 }
 
+size_t Listener::pick_acceptor()
+{
+	auto n = _pool.size();
+	switch (_dispatch)
+	{
+	case DispatchPolicy::PowerOfTwo:
+	{
+		if (n < 2) return 0;
+
+		// xorshift is plenty random for this
+		_random ^= _random << 13;
+		_random ^= _random >> 17;
+		_random ^= _random << 5;
+		size_t a = _random % n;
+		size_t b = (a + 1 + (_random >> 16) % (n - 1)) % n;
+		return _pool[b].load() < _pool[a].load() ? b : a;
+	}
+
+	case DispatchPolicy::LeastLoaded:
+	{
+		// start where the last search left off so ties are spread out
+		size_t start = _counter++ % n;
+		size_t best = start;
+		auto best_load = _pool[best].load();
+		for (size_t i = 1; i < n && best_load > 0; i++)
+		{
+			auto candidate = (start + i) % n;
+			auto load = _pool[candidate].load();
+			if (load < best_load)
+			{
+				best = candidate;
+				best_load = load;
+			}
+		}
+		return best;
+	}
+
+	default:
+		return _counter++ % n;
+	}
+}
+
 void Listener::stop()
 {
 	_running = false;
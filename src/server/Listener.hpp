@@ -1,10 +1,50 @@
 #pragma once
+#include "Uring.hpp"
+#include "MpscQueue.hpp"
+#include "Slab.hpp"
+#include "TimerWheel.hpp"
 
 class Socket;
 class SocketEventProducer;
 
 typedef std::function<void(std::shared_ptr<Socket>, std::shared_ptr<SocketEventProducer>)> socket_handler;
 
+// determines how a Listener gets connections to its acceptors
+enum class ListenMode
+{
+	Single,		// one listener thread accepts and hands connections to acceptors round-robin
+	ReusePort	// each acceptor accepts on its own SO_REUSEPORT socket bound to the same port
+};
+
+// how a Listener in Single mode picks the acceptor for a new connection
+enum class DispatchPolicy
+{
+	RoundRobin,		// each acceptor in turn
+	PowerOfTwo,		// the less loaded of two acceptors picked at random
+	LeastLoaded		// the least loaded of all acceptors
+};
+
+// the mechanism acceptors use to wait for and perform socket io
+enum class EventEngine
+{
+	Epoll,		// readiness notification followed by a read()/write() per operation
+	IoUring		// io_uring completions with multishot accept and recv (linux 6.0+)
+};
+
+// how long a connection may stay in each state before it is closed, in milliseconds. 0 disables.
+struct Timeouts
+{
+	uint32_t idle = 60000;		// keep-alive connections waiting for the next request
+	uint32_t header = 10000;	// new connections and requests that have not been fully received
+	uint32_t write = 30000;		// responses that make no progress being written
+};
+
+// the state a connection is in for the purpose of timing it out
+enum class Deadline
+{
+	None, Idle, Header, Write
+};
+
 // receives events that happen on a socket
 class SocketEventReceiver
 {
@@ -50,6 +90,56 @@ public:
 	virtual ssize_t read(void* b, size_t max) = 0;
 	virtual ssize_t write(const void* b, size_t amt) = 0;
 	virtual void close() {}
+
+	// write several buffers in one go. Writes less than everything only if the socket is full.
+	virtual ssize_t writev(const iovec* iov, int iovcnt)
+	{
+		ssize_t total = 0;
+		for (int i = 0; i < iovcnt; i++)
+		{
+			// a write may take less than it could, e.g. one tls record at a time
+			size_t done = 0;
+			while (done < iov[i].iov_len)
+			{
+				auto r = write(static_cast<const char*>(iov[i].iov_base) + done, iov[i].iov_len - done);
+				if (r <= 0) return total > 0 ? total : r;
+
+				done += static_cast<size_t>(r);
+				total += r;
+			}
+		}
+		return total;
+	}
+
+	// the file descriptor of the socket, or -1 if it does not have one of its own
+	virtual int fd() { return -1; }
+
+	// whether sendfile sends straight from the file without copying through user space
+	virtual bool can_sendfile() const { return false; }
+
+	// write up to count bytes of a file starting at offset. Sockets that can't send from a file
+	// directly read a chunk of it and write that.
+	virtual ssize_t sendfile(int fd, off_t offset, size_t count)
+	{
+		char buffer[16384];
+		auto r = ::pread(fd, buffer, std::min(count, sizeof(buffer)), offset);
+		if (r <= 0) return 0;
+		return write(buffer, static_cast<size_t>(r));
+	}
+
+	// whether wake can be called
+	virtual bool can_wake() const { return false; }
+
+	// have read_avail signalled again by the thread that owns the socket, e.g. when work handed to
+	// another thread is done. Can be called from any thread. Returns false if that failed.
+	virtual bool wake() { return false; }
+
+	// whether what was read last came before the connection was fully established, such as tls
+	// early data, and so may be a replay
+	virtual bool early_data() const { return false; }
+
+	// (re)start the timeout for a state. The connection is closed if it runs out.
+	virtual void set_deadline(Deadline deadline) {}
 };
 
 // an implementation for Socket on top of linux sockets.
@@ -61,9 +151,12 @@ public:
 
 	virtual ssize_t read(void* b, size_t max) override;
 	virtual ssize_t write(const void* b, size_t amt) override;
+	virtual ssize_t writev(const iovec* iov, int iovcnt) override;
+	virtual bool can_sendfile() const override { return true; }
+	virtual ssize_t sendfile(int fd, off_t offset, size_t count) override;
 	virtual void close() override;
 
-	int fd() { return _fd; }
+	virtual int fd() override { return _fd; }
 private:
 	int _fd;
 };
@@ -72,13 +165,38 @@ private:
 class Acceptor
 {
 public:
-	Acceptor(int nr);
+	// cpu is the cpu to pin the thread to, or -1 to let it float
+	Acceptor(int nr, int cpu = -1, EventEngine engine = EventEngine::Epoll, Timeouts timeouts = Timeouts());
 	Acceptor(const Acceptor&) = delete;
 	Acceptor(Acceptor&&) { /*should never be called*/ abort(); }
 	Acceptor& operator=(const Acceptor&) = delete;
 	~Acceptor();
 
-	void accept(std::shared_ptr<LinuxSocket>, socket_handler acceptHandler);
+	// hands an accepted connection to this acceptor. Can be called from any thread; the acceptor
+	// registers the connection itself after the next notify(). Returns false if its queue is full.
+	bool accept(int fd, const socket_handler *acceptHandler);
+
+	// hands a listening socket to this acceptor to accept on by itself. Takes effect after
+	// the next notify(). The acceptor closes the socket when it stops.
+	bool listen(int lfd, const socket_handler *acceptHandler);
+
+	// have this acceptor stop accepting on a socket it was given with listen(), and close it.
+	// Takes effect after the next notify().
+	bool unlisten(int lfd);
+
+	// wake the acceptor up to pick up handed off connections. Wakeups are coalesced
+	// until the acceptor gets around to it.
+	void notify();
+
+	// how busy the acceptor is, in connections. Combines the connections it has or is about to
+	// get, the bytes waiting to be sent and how long its loop takes. Can be called from any thread.
+	uint32_t load() const;
+
+	// the cpu the thread is pinned to, or -1
+	inline int cpu() const { return _cpu; }
+
+	// stop the event loop, close all connections
+	void stop();
 private:
 
 	class LocalSocketEventProducer : public SocketEventProducer
@@ -93,7 +211,7 @@ private:
 	class LocalSocket : public Socket
 	{
 	public:
-		LocalSocket(std::shared_ptr<LinuxSocket> socket, Acceptor& acceptor) :_socket(socket), _acceptor(acceptor) {}
+		LocalSocket(std::shared_ptr<LinuxSocket> socket, uint64_t key, Acceptor& acceptor) :_socket(socket), _key(key), _acceptor(acceptor) {}
 		virtual ~LocalSocket() { close(); }
 
 		virtual ssize_t read(void* b, size_t max) override
@@ -108,45 +226,236 @@ private:
 			return _socket->write(b, amt);
 		}
 
+		virtual ssize_t writev(const iovec* iov, int iovcnt) override
+		{
+			if (!_socket) return 0;
+			return _socket->writev(iov, iovcnt);
+		}
+
+		virtual int fd() override
+		{
+			return _socket ? _socket->fd() : -1;
+		}
+
+		virtual bool can_sendfile() const override { return true; }
+
+		virtual ssize_t sendfile(int fd, off_t offset, size_t count) override
+		{
+			if (!_socket) return 0;
+			return _socket->sendfile(fd, offset, count);
+		}
+
 		virtual void close() override
 		{
 			if (!_socket) return;
 
-			auto iter = _acceptor._sockets.find(_socket->fd());
-			if (iter != _acceptor._sockets.end())
-			{
-				_acceptor._sockets.erase(iter);
-			}
+			_acceptor.retire(_key);
 			_socket->close();
 			_socket.reset();
 		}
 
+		virtual void set_deadline(Deadline deadline) override
+		{
+			if (_socket) _acceptor.set_deadline(_key, deadline);
+		}
+		virtual bool can_wake() const override { return true; }
+		virtual bool wake() override { return _acceptor.wake(_key); }
+
 	private:
 		std::shared_ptr<LinuxSocket> _socket;
+		uint64_t _key;
 		Acceptor& _acceptor;
 	};
 
-	void worker();
-	void stop();
+	// a connection driven by io_uring completions. Reads are served from the ring buffers
+	// the kernel received into, writes are staged and sent in one request per loop pass.
+	class UringSocket : public Socket
+	{
+	public:
+		UringSocket(int fd, uint64_t id, Acceptor& acceptor) :_fd(fd), _id(id), _acceptor(acceptor) {}
+		virtual ~UringSocket() { close(); }
+
+		virtual ssize_t read(void* b, size_t max) override;
+		virtual ssize_t write(const void* b, size_t amt) override;
+		virtual void close() override;
+		virtual void set_deadline(Deadline deadline) override { if (_fd != -1) _acceptor.set_deadline(_id, deadline); }
+		virtual bool can_wake() const override { return true; }
+		virtual bool wake() override { return _acceptor.wake(_id); }
+
+	private:
+		int _fd;
+		uint64_t _id;
+		Acceptor& _acceptor;
+
+		bool _eof = false;
+		bool _queued = false;
+		bool _recv_armed = false;
+		bool _send_armed = false;
+		int _inflight = 0;
+
+		// the ring buffer being dispatched and data left over from earlier ones
+		const char* _recv_data = nullptr;
+		size_t _recv_left = 0;
+		std::vector<char> _input;
+		size_t _input_read = 0;
+
+		// data written since the last send and data owned by the send in flight
+		std::vector<char> _output;
+		std::vector<char> _sending;
+		size_t _sent = 0;
+
+		friend class Acceptor;
+	};
+
+	enum class UringOp : uint8_t
+	{
+		Stop, Accept, Backoff, Handoff, Timer, Recv, Send, Cancel
+	};
+
+	enum class HandoffKind : uint8_t
+	{
+		Connection, Listen, Unlisten
+	};
+
+	struct handoff
+	{
+		int fd;
+		const socket_handler *acceptHandler;
+		HandoffKind kind;
+	};
+
+	struct listen_socket
+	{
+		int fd;
+		const socket_handler *acceptHandler;
+	};
+
+	struct connection
+	{
+		std::shared_ptr<LocalSocketEventProducer> events;
+		std::shared_ptr<LinuxSocket> socket;
+		TimerWheel::Timer timer;
+	};
+
+	struct uring_connection
+	{
+		std::shared_ptr<LocalSocketEventProducer> events;
+		std::shared_ptr<UringSocket> socket;
+		TimerWheel::Timer timer;
+	};
+
+	void worker(std::promise<void> &started);
+	void epoll_worker();
+	void accept_all(const listen_socket &ls);
+	void take_handoffs();
+	bool wake(uint64_t key);
+	void take_wakeups();
+	void add_listener(int lfd, const socket_handler *acceptHandler);
+	void remove_listener(int lfd);
+	void add_socket(int fd, const socket_handler &acceptHandler);
+	void retire(uint64_t key);
+
+	void publish_load(uint64_t busy);
+
+	void set_deadline(uint64_t key, Deadline deadline);
+	void run_timers();
+	void expire(uint64_t key);
+
+	void uring_worker();
+	void uring_complete(const io_uring_cqe &cqe);
+	void uring_arm_handoff();
+	void uring_arm_timer();
+	void uring_arm_accept(size_t index);
+	void uring_arm_backoff(size_t index);
+	void uring_accept(int fd, const socket_handler &acceptHandler);
+	void uring_received(LocalSocketEventProducer &events, UringSocket &socket, const io_uring_cqe &cqe);
+	void uring_sent(LocalSocketEventProducer &events, UringSocket &socket, const io_uring_cqe &cqe);
+	void uring_eof(LocalSocketEventProducer &events, UringSocket &socket);
+	void uring_queue(UringSocket &socket);
+	void uring_flush();
+	void uring_close(UringSocket &socket);
+	io_uring_sqe *uring_sqe(UringOp op, uint64_t id = 0);
 
 	int _nr;
+	int _cpu;
 	int _pfd[2];
 	int _efd;
+	int _qfd;
+	int _tfd;
 	bool _running;
+	EventEngine _engine;
 	std::thread _thread;
-	std::unordered_map<int, std::pair<std::shared_ptr<LocalSocketEventProducer>,std::shared_ptr<LinuxSocket>>> _sockets;
+	std::vector<listen_socket> _listeners;
+	// epoll events carry the slab key of their connection. Connections closed while handling
+	// events are retired immediately and released once the whole batch is handled.
+	Slab<connection> _sockets;
+	std::vector<uint64_t> _closed;
+
+	// connection timeouts, checked against a clock read once per loop iteration.
+	// The timerfd ticks only while there are timers.
+	Timeouts _timeouts;
+	uint64_t _now;
+	std::unique_ptr<TimerWheel> _timers;
+	bool _timer_armed;
+
+	// load counters read by other threads. Connections are counted from the moment they are handed
+	// to us until we close them; staged output is only known for io_uring.
+	std::atomic<uint32_t> _connections;
+	std::atomic<uint32_t> _pending_bytes;
+	std::atomic<uint32_t> _loop_latency;
+	size_t _staged;
+
+	// the queues and the timer wheel are allocated by the thread, on its own numa node
+	std::atomic<bool> _wake_pending;
+	std::unique_ptr<MpscQueue<handoff, 4096>> _handoffs;
+	// keys of connections to signal read_avail on for other threads. They go through the same eventfd.
+	std::unique_ptr<MpscQueue<uint64_t, 4096>> _wakeups;
+
+	std::unique_ptr<Uring> _ring;
+	std::unique_ptr<UringBufferRing> _buffers;
+	std::vector<uint64_t> _uring_queued;
+	std::vector<uint64_t> _uring_closed;
+	Slab<uring_connection> _uring_sockets;
 };
 
-// listens for traffic and forwards accepted sockets to an Acceptor
+// the event loop threads shared by all listeners. One thread per cpu the process may use,
+// each pinned to its cpu so it stays close to its memory and the traffic steered to it.
+class AcceptorPool
+{
+	using iterator = std::vector<Acceptor>::iterator;
+public:
+	AcceptorPool(EventEngine engine = EventEngine::Epoll, Timeouts timeouts = Timeouts());
+	~AcceptorPool();
+	AcceptorPool(const AcceptorPool&) = delete;
+	AcceptorPool& operator=(const AcceptorPool&) = delete;
+
+	// keep a handler alive for as long as the acceptors might call it
+	const socket_handler *add_handler(socket_handler acceptHandler);
+
+	inline size_t size() const { return _acceptors.size(); }
+	inline Acceptor &operator[](size_t i) { return _acceptors[i]; }
+	inline iterator begin() { return _acceptors.begin(); }
+	inline iterator end() { return _acceptors.end(); }
+
+	// stop all acceptors, close all connections
+	void stop();
+private:
+	std::vector<Acceptor> initialize_acceptors(EventEngine engine, Timeouts timeouts);
+
+	std::vector<std::unique_ptr<socket_handler>> _handlers;
+	std::vector<Acceptor> _acceptors;
+};
+
+// listens for traffic and forwards accepted sockets to the acceptors of a pool
 class Listener
 {
 public:
-	Listener(const char* address, int port, socket_handler acceptHandler);
+	Listener(AcceptorPool &pool, const char* address, int port, socket_handler acceptHandler, ListenMode mode = ListenMode::ReusePort, DispatchPolicy dispatch = DispatchPolicy::PowerOfTwo);
 	~Listener();
 	Listener(const Listener&) = delete;
 	Listener& operator=(const Listener&) = delete;
 
-	// stop the listener, close all connections
+	// stop listening. Connections are closed when the pool stops.
 	void stop();
 
 	// wait until the listener is explicitly stopped
@@ -155,16 +464,21 @@ private:
 
 	static int initialize_epoll();
 	int initialize_socket(const char* address, int port);
-	std::vector<Acceptor> initialize_acceptors();
+	void initialize_reuseport(const char* address, int port);
 	void worker();
+	size_t pick_acceptor();
 
 	int _pfd[2];
 	int _port;
 	int _efd;
 	int _sfd;
 	int _counter;
+	uint32_t _random;
 	bool _running = true;
+	DispatchPolicy _dispatch;
+	AcceptorPool &_pool;
+	const socket_handler *_acceptHandler;
+	// the reuseport sockets handed to the acceptors, one per acceptor
+	std::vector<int> _reuseport_fds;
 	std::thread _thread;
-	std::vector<Acceptor> _acceptors;
-	socket_handler _acceptHandler;
 };
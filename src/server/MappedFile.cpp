@@ -14,6 +14,12 @@ MappedFile::MappedFile(std::string filename)
 		throw std::runtime_error("could not stat file");
 	}
 	filesize = filestats.st_size;
+	inodenumber = filestats.st_ino;
+	modifiedtime = filestats.st_mtim;
+
+	// empty files can't be mapped, and have nothing to map
+	pointer = nullptr;
+	if (filesize == 0) return;
 
 	pointer = static_cast<char*>(mmap(nullptr, filesize, PROT_READ, MAP_SHARED, fd, 0));
 	if (!pointer || pointer == MAP_FAILED)
@@ -9,7 +9,7 @@ public:
 	MappedFile(const MappedFile &) = delete;
 	MappedFile& operator=(const MappedFile&) = delete;
 	MappedFile(MappedFile &&o)
-		:pointer(o.pointer), filesize(o.filesize), fd(o.fd), filename(std::move(o.filename))
+		:pointer(o.pointer), filesize(o.filesize), fd(o.fd), inodenumber(o.inodenumber), modifiedtime(o.modifiedtime), filename(std::move(o.filename))
 	{
 		o.pointer = nullptr;
 		o.filesize = 0;
@@ -22,10 +22,16 @@ public:
 	inline char &operator[](size_t pos) { if (pos > filesize) throw std::out_of_range("pos out of range"); return *(pointer + pos); }
 	inline const char &operator[](size_t pos) const { if (pos > filesize) throw std::out_of_range("pos out of range"); return *(pointer + pos); }
 	inline size_t size() const { return filesize; }
+	inline const char *data() const { return pointer; }
 	inline const std::string &name() const { return filename; }
+	inline int descriptor() const { return fd; }
+	inline ino_t inode() const { return inodenumber; }
+	inline const timespec &modified() const { return modifiedtime; }
 private:
 	char *pointer;
 	size_t filesize;
 	int fd;
+	ino_t inodenumber;
+	timespec modifiedtime;
 	std::string filename;
 };
@@ -0,0 +1,75 @@
+#pragma once
+
+// a bounded lock-free queue for many producers and a single consumer.
+// Every cell carries a sequence number that tells producers and the consumer
+// whose turn it is, so a push is one CAS and a pop needs no atomic rmw at all.
+template<typename T, size_t N>
+class MpscQueue
+{
+	static_assert(N >= 2 && (N & (N - 1)) == 0, "queue size must be a power of two");
+public:
+	MpscQueue()
+		: _enqueue(0), _dequeue(0)
+	{
+		for (size_t i = 0; i < N; i++) _cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	MpscQueue(const MpscQueue&) = delete;
+	MpscQueue& operator=(const MpscQueue&) = delete;
+
+	// add an item. Can be called from any thread. Returns false if the queue is full.
+	bool push(const T &value)
+	{
+		auto pos = _enqueue.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			auto &cell = _cells[pos & (N - 1)];
+			auto seq = cell.sequence.load(std::memory_order_acquire);
+			auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+			if (diff == 0)
+			{
+				if (_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					cell.value = value;
+					cell.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false;
+			}
+			else
+			{
+				pos = _enqueue.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// take the oldest item. Must only be called from the consuming thread.
+	bool pop(T &value)
+	{
+		auto &cell = _cells[_dequeue & (N - 1)];
+		auto seq = cell.sequence.load(std::memory_order_acquire);
+		if (static_cast<intptr_t>(seq) - static_cast<intptr_t>(_dequeue + 1) < 0)
+		{
+			return false;
+		}
+
+		value = cell.value;
+		cell.sequence.store(_dequeue + N, std::memory_order_release);
+		_dequeue++;
+		return true;
+	}
+
+private:
+	struct cell
+	{
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	alignas(64) std::atomic<size_t> _enqueue;
+	alignas(64) size_t _dequeue;
+	alignas(64) std::array<cell, N> _cells;
+};
@@ -0,0 +1,90 @@
+#pragma once
+
+// a table of slots addressed by a key made of the slot index and a generation.
+// Slots live in fixed size chunks so they never move, and the generation changes
+// every time a slot is retired so keys of old occupants no longer find anything.
+// Not thread safe.
+template<typename T>
+class Slab
+{
+public:
+	static constexpr unsigned INDEX_BITS = 24;
+	static constexpr size_t CHUNK_SIZE = 1024;
+
+	Slab() {}
+	Slab(const Slab&) = delete;
+	Slab& operator=(const Slab&) = delete;
+
+	// store a value and get its key. Keys are never zero and never below 2^INDEX_BITS.
+	uint64_t insert(T &&value)
+	{
+		uint32_t index;
+		if (!_free.empty())
+		{
+			index = _free.back();
+			_free.pop_back();
+		}
+		else
+		{
+			index = _size++;
+			if (index >= (1u << INDEX_BITS)) throw std::runtime_error("slab is full");
+			if (index / CHUNK_SIZE >= _chunks.size()) _chunks.emplace_back(new slot[CHUNK_SIZE]);
+		}
+
+		auto &s = at(index);
+		s.value = std::move(value);
+		return (static_cast<uint64_t>(s.generation) << INDEX_BITS) | index;
+	}
+
+	// the value for a key or nullptr if the key is stale
+	inline T *find(uint64_t key)
+	{
+		auto index = static_cast<uint32_t>(key & ((1u << INDEX_BITS) - 1));
+		if (index >= _size) return nullptr;
+		auto &s = at(index);
+		return s.generation == (key >> INDEX_BITS) ? &s.value : nullptr;
+	}
+
+	// make a key stale without destroying the value yet. Returns false if it already was.
+	bool retire(uint64_t key)
+	{
+		if (!find(key)) return false;
+		auto &s = at(static_cast<uint32_t>(key & ((1u << INDEX_BITS) - 1)));
+		if (++s.generation == 0) s.generation = 1;
+		return true;
+	}
+
+	// destroy the value of a retired key and make the slot available again
+	void release(uint64_t key)
+	{
+		auto index = static_cast<uint32_t>(key & ((1u << INDEX_BITS) - 1));
+		at(index).value = T();
+		_free.push_back(index);
+	}
+
+	void erase(uint64_t key)
+	{
+		if (retire(key)) release(key);
+	}
+
+	void clear()
+	{
+		for (uint32_t i = 0; i < _size; i++) at(i).value = T();
+		_chunks.clear();
+		_free.clear();
+		_size = 0;
+	}
+
+private:
+	struct slot
+	{
+		uint32_t generation = 1;
+		T value;
+	};
+
+	inline slot &at(uint32_t index) { return _chunks[index / CHUNK_SIZE][index % CHUNK_SIZE]; }
+
+	std::vector<std::unique_ptr<slot[]>> _chunks;
+	std::vector<uint32_t> _free;
+	uint32_t _size = 0;
+};
@@ -0,0 +1,101 @@
+#include "pch.hpp"
+#include "TimerWheel.hpp"
+
+
+// TimerWheel::Timer
+
+void TimerWheel::Timer::cancel()
+{
+	if (!_wheel) return;
+
+	prev->next = next;
+	next->prev = prev;
+	prev = next = nullptr;
+	_wheel->_count--;
+	_wheel = nullptr;
+}
+
+
+// TimerWheel
+
+TimerWheel::TimerWheel(uint32_t tick, uint64_t now)
+	: _tick(tick ? tick : 1),
+	_current(now / _tick),
+	_count(0)
+{
+	for (auto &level : _slots)
+	{
+		for (auto &head : level) head.prev = head.next = &head;
+	}
+}
+
+TimerWheel::~TimerWheel()
+{
+	// unlink whatever is left so the timers don't point at us
+	for (auto &level : _slots)
+	{
+		for (auto &head : level)
+		{
+			while (head.next != &head) static_cast<Timer*>(head.next)->cancel();
+		}
+	}
+}
+
+void TimerWheel::schedule(Timer &timer, uint64_t when)
+{
+	timer.cancel();
+
+	// round up so a timer never fires early, and never into the slot being fired
+	auto expires = (when + _tick - 1) / _tick;
+	if (expires <= _current) expires = _current + 1;
+
+	// timers beyond the range of the wheel fire at the end of it
+	constexpr uint64_t range = 1ull << (SLOT_BITS * LEVELS);
+	if (expires - _current >= range) expires = _current + range - 1;
+
+	timer._expires = expires;
+	timer._wheel = this;
+	_count++;
+	insert(timer);
+}
+
+void TimerWheel::insert(Timer &timer)
+{
+	auto delta = timer._expires - _current;
+	unsigned level = 0;
+	while (level < LEVELS - 1 && delta >= (1ull << (SLOT_BITS * (level + 1)))) level++;
+
+	auto &head = _slots[level][(timer._expires >> (SLOT_BITS * level)) & (SLOTS - 1)];
+	timer.prev = head.prev;
+	timer.next = &head;
+	head.prev->next = &timer;
+	head.prev = &timer;
+}
+
+void TimerWheel::cascade()
+{
+	// when a level wraps around, the next slot of the level above is spread over the levels below
+	for (unsigned level = 1; level < LEVELS; level++)
+	{
+		if (_current & ((1ull << (SLOT_BITS * level)) - 1)) break;
+
+		auto &head = _slots[level][(_current >> (SLOT_BITS * level)) & (SLOTS - 1)];
+		node list;
+		if (head.next == &head) continue;
+
+		// detach the whole slot first since reinserting may land in it again
+		list.next = head.next;
+		list.prev = head.prev;
+		list.next->prev = &list;
+		list.prev->next = &list;
+		head.prev = head.next = &head;
+
+		while (list.next != &list)
+		{
+			auto timer = static_cast<Timer*>(list.next);
+			list.next = timer->next;
+			list.next->prev = &list;
+			insert(*timer);
+		}
+	}
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+// a hierarchical timing wheel. Timers are intrusive list nodes hashed into slots by their
+// expiry tick, so scheduling and cancelling are O(1) no matter how many timers there are.
+// Each level has SLOTS slots spanning SLOTS times the range of the level below it; timers
+// in higher levels are moved down when the level below wraps around.
+// Not thread safe; one wheel is owned by one thread.
+class TimerWheel
+{
+	struct node
+	{
+		node *prev = nullptr;
+		node *next = nullptr;
+	};
+
+public:
+	static constexpr unsigned SLOT_BITS = 6;
+	static constexpr unsigned SLOTS = 1u << SLOT_BITS;
+	static constexpr unsigned LEVELS = 4;
+
+	class Timer : private node
+	{
+	public:
+		Timer(uint64_t data = 0) : data(data) {}
+		~Timer() { cancel(); }
+
+		// copies carry the data but are never scheduled
+		Timer(const Timer &other) : data(other.data) {}
+		Timer& operator=(const Timer &other) { cancel(); data = other.data; return *this; }
+
+		inline bool scheduled() const { return _wheel != nullptr; }
+		void cancel();
+
+		// whatever the owner needs to find what the timer belongs to
+		uint64_t data;
+
+	private:
+		TimerWheel *_wheel = nullptr;
+		uint64_t _expires = 0;
+
+		friend class TimerWheel;
+	};
+
+	// tick is the resolution in milliseconds. Timers fire at most one tick late.
+	TimerWheel(uint32_t tick, uint64_t now);
+	TimerWheel(const TimerWheel&) = delete;
+	TimerWheel& operator=(const TimerWheel&) = delete;
+	~TimerWheel();
+
+	// (re)schedule a timer to fire at the given time in milliseconds
+	void schedule(Timer &timer, uint64_t when);
+
+	// fire every timer that expired by now. The callback may schedule and cancel timers.
+	template<typename F>
+	void advance(uint64_t now, F f)
+	{
+		auto target = now / _tick;
+		if (_count == 0)
+		{
+			// nothing to cascade or fire
+			if (target > _current) _current = target;
+			return;
+		}
+
+		while (_current < target)
+		{
+			_current++;
+			cascade();
+
+			auto &head = _slots[0][_current & (SLOTS - 1)];
+			while (head.next != &head)
+			{
+				auto timer = static_cast<Timer*>(head.next);
+				timer->cancel();
+				f(*timer);
+			}
+
+			if (_count == 0)
+			{
+				_current = target;
+				break;
+			}
+		}
+	}
+
+	inline size_t size() const { return _count; }
+
+private:
+	void insert(Timer &timer);
+	void cascade();
+
+	uint32_t _tick;
+	uint64_t _current;
+	size_t _count;
+	node _slots[LEVELS][SLOTS];
+};
@@ -2,6 +2,13 @@
 #include "Listener.hpp"
 #include "Tls.hpp"
 
+// room for two full tls records (16KB of data plus overhead) in each direction
+static constexpr size_t TLS_RING_SIZE = 36 * 1024;
+// early data is read into a buffer this much at a time
+static constexpr size_t TLS_EARLY_DATA_CHUNK = 4096;
+// tickets remembered to keep early data from being replayed. Early data is refused beyond that.
+static constexpr size_t TLS_EARLY_DATA_TICKETS = 64 * 1024;
+
 static int _get_tls_error_string_cb(const char *str, size_t len, void *u)
 {
 	std::string &s = *reinterpret_cast<std::string *>(u);
@@ -18,16 +25,78 @@ std::string get_tls_error_string()
 
 
 
-void BIO_advance(BIO* bio, size_t howfar)
+// a BIO that reads from or writes into a ByteRing. The socket fills and drains the ring directly,
+// and since the ring never grows there is nothing to reallocate while records come and go.
+static int ring_bio_write(BIO* bio, const char* b, int amt)
+{
+	BIO_clear_retry_flags(bio);
+	if (amt <= 0) return 0;
+
+	auto written = static_cast<ByteRing*>(BIO_get_data(bio))->put(b, static_cast<size_t>(amt));
+	if (written == 0)
+	{
+		// full. Comes back once the socket took some.
+		BIO_set_retry_write(bio);
+		return -1;
+	}
+
+	return static_cast<int>(written);
+}
+
+static int ring_bio_read(BIO* bio, char* b, int amt)
 {
-	if (howfar > 0)
+	BIO_clear_retry_flags(bio);
+	if (amt <= 0) return 0;
+
+	auto read = static_cast<ByteRing*>(BIO_get_data(bio))->get(b, static_cast<size_t>(amt));
+	if (read == 0)
 	{
-		BIO_clear_retry_flags(bio);
-		BUF_MEM* ptr;
-		BIO_get_mem_ptr(bio, &ptr);
-		ptr->data += howfar;
-		ptr->length -= howfar;
+		// empty. Comes back once the socket gave us more.
+		BIO_set_retry_read(bio);
+		return -1;
 	}
+
+	return static_cast<int>(read);
+}
+
+static long ring_bio_ctrl(BIO* bio, int cmd, long num, void* ptr)
+{
+	switch (cmd)
+	{
+	case BIO_CTRL_PENDING:
+	case BIO_CTRL_WPENDING:
+		return static_cast<long>(static_cast<ByteRing*>(BIO_get_data(bio))->size());
+	case BIO_CTRL_FLUSH:
+		// the socket is written separately
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static int ring_bio_create(BIO* bio)
+{
+	BIO_set_init(bio, 1);
+	return 1;
+}
+
+BIO *BIO_new_ring(ByteRing &ring)
+{
+	static BIO_METHOD *method = []()
+	{
+		auto m = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "byte ring");
+		if (!m) throw tls_error("could not create BIO method");
+
+		BIO_meth_set_write(m, ring_bio_write);
+		BIO_meth_set_read(m, ring_bio_read);
+		BIO_meth_set_ctrl(m, ring_bio_ctrl);
+		BIO_meth_set_create(m, ring_bio_create);
+		return m;
+	}();
+
+	auto bio = BIO_new(method);
+	if (bio) BIO_set_data(bio, &ring);
+	return bio;
 }
 
 X509 *load_cert(const char *file)
@@ -66,6 +135,63 @@ int ssl_servername_cb(SSL *s, int *ad, Tls *tls)
 	return SSL_TLSEXT_ERR_NOACK;
 }
 
+int client_hello_cb(SSL *s, int *al, void *arg)
+{
+	auto socket = static_cast<TlsSocket*>(SSL_get_app_data(s));
+	return socket && socket->offload_hello() ? SSL_CLIENT_HELLO_RETRY : SSL_CLIENT_HELLO_SUCCESS;
+}
+
+int ticket_key_cb(SSL *s, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc)
+{
+	auto tls = static_cast<Tls*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(s)));
+	if (!tls) return -1;
+
+	// a ticket carries early data only once, so tls 1.3 clients get a new one every time
+	auto result = tls->_tickets.crypt(name, iv, ctx, hctx, enc);
+	if (!enc && result == 1 && tls->_max_early_data && SSL_version(s) == TLS1_3_VERSION) result = 2;
+	return result;
+}
+
+int session_new_cb(SSL *s, SSL_SESSION *session)
+{
+	auto tls = static_cast<Tls*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(s)));
+	if (tls && tls->_sessions) tls->_sessions->add(session);
+
+	// the cache keeps its own copy
+	return 0;
+}
+
+SSL_SESSION *session_get_cb(SSL *s, const unsigned char *id, int idlen, int *copy)
+{
+	auto tls = static_cast<Tls*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(s)));
+	*copy = 0;
+	return tls && tls->_sessions ? tls->_sessions->find(id, idlen) : nullptr;
+}
+
+void session_remove_cb(SSL_CTX *ctx, SSL_SESSION *session)
+{
+	auto tls = static_cast<Tls*>(SSL_CTX_get_app_data(ctx));
+	if (tls && tls->_sessions)
+	{
+		unsigned int idlen;
+		auto id = SSL_SESSION_get_id(session, &idlen);
+		tls->_sessions->remove(id, static_cast<int>(idlen));
+	}
+}
+
+int early_data_cb(SSL *s, void *arg)
+{
+	auto tls = static_cast<Tls*>(arg);
+	auto session = SSL_get0_session(s);
+	return tls && tls->_early_data && session && tls->_early_data->allow(session) ? 1 : 0;
+}
+
+int ocsp_status_cb(SSL *s, void *arg)
+{
+	auto tls = static_cast<Tls*>(arg);
+	return tls && tls->_ocsp && tls->_ocsp->staple(s) ? SSL_TLSEXT_ERR_OK : SSL_TLSEXT_ERR_NOACK;
+}
+
 int alpn_cb(SSL *s, const unsigned char **out, unsigned char *outlen,
 	const unsigned char *in, unsigned int inlen, void *usr)
 {
@@ -81,7 +207,11 @@ std::vector<std::string> get_hostnames(X509* cert)
 
 	auto name = X509_get_subject_name(cert);
 	auto namelen = X509_NAME_get_text_by_NID(name, NID_commonName, buf, sizeof(buf));
-	names.emplace_back(buf, namelen);
+	if (namelen > 0)
+	{
+		names.emplace_back(buf, namelen);
+		std::transform(names[0].begin(), names[0].end(), names[0].begin(), [](unsigned char c) { return static_cast<char>(tolower(c)); });
+	}
 
 	GENERAL_NAMES *gs = static_cast<GENERAL_NAMES*>(X509_get_ext_d2i(cert, NID_subject_alt_name, nullptr, nullptr));
 
@@ -94,6 +224,7 @@ std::vector<std::string> get_hostnames(X509* cert)
 			if (dns->data && dns->length > 0)
 			{
 				std::string s(reinterpret_cast<const char*>(dns->data), dns->length);
+				std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return static_cast<char>(tolower(c)); });
 				if (std::find(names.begin(), names.end(), s) == names.end())
 				{
 					names.push_back(s);
@@ -106,8 +237,8 @@ std::vector<std::string> get_hostnames(X509* cert)
 	return names;
 }
 
-TlsContext::TlsContext(const char* certificate, const char* key, Tls *tls)
-	:_tls(tls)
+TlsContext::TlsContext(const std::vector<std::pair<std::string, std::string>> &files, Tls *tls)
+	:_tls(tls), _ctx(nullptr)
 {
 	const SSL_METHOD* method = SSLv23_server_method();
 	SSL_CTX* ctx = SSL_CTX_new(method);
@@ -116,63 +247,104 @@ TlsContext::TlsContext(const char* certificate, const char* key, Tls *tls)
 		throw tls_error("Unable to create SSL context");
 	}
 
-	auto cert = load_cert(certificate);
-	if (SSL_CTX_use_certificate(ctx, cert) <= 0)
+	// certificates are loaded again on reload, so a bad one mustn't leak the context
+	_ctx = ctx;
+	try
 	{
-		throw tls_error("Unable to use certificate");
-	}
+		// openssl keeps a certificate for each type of key and picks one by what the client supports
+		for (const auto &file : files)
+		{
+			auto cert = load_cert(file.first.c_str());
+			auto used = SSL_CTX_use_certificate(ctx, cert);
+			for (auto &name : get_hostnames(cert))
+			{
+				if (std::find(_hostnames.begin(), _hostnames.end(), name) == _hostnames.end())
+				{
+					_hostnames.push_back(std::move(name));
+				}
+			}
+			// the context holds a reference of its own
+			X509_free(cert);
 
-	if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) <= 0)
-	{
-		throw tls_error("Unable to read key");
-	}
+			if (used <= 0)
+			{
+				throw tls_error("Unable to use certificate");
+			}
 
-	if (SSL_CTX_check_private_key(ctx) != 1)
-	{
-		throw tls_error("SSL_CTX_check_private_key failed");
-	}
+			if (SSL_CTX_use_PrivateKey_file(ctx, file.second.c_str(), SSL_FILETYPE_PEM) <= 0)
+			{
+				throw tls_error("Unable to read key");
+			}
 
-	_cert = cert;
-	_hostnames = get_hostnames(cert);
+			if (SSL_CTX_check_private_key(ctx) != 1)
+			{
+				throw tls_error("SSL_CTX_check_private_key failed");
+			}
+		}
 
-	// disable anything below tls 1.2
-	SSL_CTX_set_options(ctx, SSL_PROTOCOL_FLAGS);
-	SSL_CTX_set_cipher_list(ctx, SSL_CIPHER_LIST);
-	SSL_CTX_set_tlsext_servername_callback(ctx, ssl_servername_cb);
-	SSL_CTX_set_tlsext_servername_arg(ctx, tls);
-	SSL_CTX_set_alpn_select_cb(ctx, alpn_cb, tls);
+		// disable anything below tls 1.2
+		SSL_CTX_set_options(ctx, SSL_PROTOCOL_FLAGS);
+		SSL_CTX_set_cipher_list(ctx, SSL_CIPHER_LIST);
+		SSL_CTX_set_ciphersuites(ctx, TLS13_CIPHER_SUITES);
+		SSL_CTX_set_tlsext_servername_callback(ctx, ssl_servername_cb);
+		SSL_CTX_set_tlsext_servername_arg(ctx, tls);
+		SSL_CTX_set_alpn_select_cb(ctx, alpn_cb, tls);
+		SSL_CTX_set_client_hello_cb(ctx, client_hello_cb, nullptr);
+		SSL_CTX_set_tlsext_status_cb(ctx, ocsp_status_cb);
+		SSL_CTX_set_tlsext_status_arg(ctx, tls);
+
+		// clients that send a key share for a group we take need no extra round trip, which would
+		// also cost them their early data
+		if (SSL_CTX_set1_groups_list(ctx, tls->_groups.c_str()) != 1)
+		{
+			throw tls_error("SSL_CTX_set1_groups_list failed");
+		}
 
-	// ecdh for temp stuff
-	auto ecdh = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
-	if (!ecdh)
+		tls->configure_sessions(ctx);
+	}
+	catch (...)
 	{
-		throw tls_error("EC_KEY_new_by_curv_name failed");
+		SSL_CTX_free(_ctx);
+		throw;
 	}
-	SSL_CTX_set_tmp_ecdh(ctx, ecdh);
-	EC_KEY_free(ecdh);
+}
 
+TlsContext::~TlsContext()
+{
+	if (_ctx) { SSL_CTX_free(_ctx); _ctx = nullptr; }
+}
 
 
-	_ctx = ctx;
 
-}
+// CertificateSet
 
-TlsContext::TlsContext(TlsContext && old)
-	: _tls(old._tls), _ctx(old._ctx), _cert(nullptr)
+CertificateSet::CertificateSet(std::vector<std::shared_ptr<TlsContext>> contexts)
+	: _contexts(std::move(contexts))
 {
-	old._ctx = nullptr;
-	old._tls = nullptr;
+	for (size_t i = 0; i < _contexts.size(); i++)
+	{
+		for (const auto &name : _contexts[i]->hostnames())
+		{
+			// the names live as long as the contexts, and so as long as the set
+			std::string_view n(name);
+			if (startswith(name, "*.")) _wildcards.emplace(n.substr(2), i);
+			else if (n.find('*') == std::string_view::npos) _names.emplace(n, i);
+		}
+	}
 }
 
-TlsContext::~TlsContext()
+std::shared_ptr<TlsContext> CertificateSet::find(std::string_view hostname) const
 {
-	if (_cert) { X509_free(_cert); }
-	if (_ctx) { SSL_CTX_free(_ctx); _ctx = nullptr; }
-}
+	auto name = _names.find(hostname);
+	if (name != _names.end()) return _contexts[name->second];
 
-bool TlsContext::does_hostname_match(const std::string &hostname) const
-{
-	return std::find(_hostnames.begin(), _hostnames.end(), hostname) != _hostnames.end();
+	auto dot = hostname.find('.');
+	if (dot == std::string_view::npos || dot == 0) return nullptr;
+
+	auto wildcard = _wildcards.find(hostname.substr(dot + 1));
+	if (wildcard != _wildcards.end()) return _contexts[wildcard->second];
+
+	return nullptr;
 }
 
 
@@ -180,6 +352,7 @@ bool TlsContext::does_hostname_match(const std::string &hostname) const
 // Tls
 
 Tls::Tls()
+	: _certificates(new CertificateSet({})), _handshakes(0), _resumptions(0)
 {
 	SSL_library_init();
 	OpenSSL_add_all_algorithms();
@@ -194,69 +367,189 @@ Tls::~Tls()
 
 void Tls::add_certificate(const char* certificate, const char* key)
 {
-	_contexts.emplace_back(certificate, key, this);
+	add_certificate({ { certificate, key } });
+}
+
+void Tls::add_certificate(const std::vector<std::pair<std::string, std::string>> &files)
+{
+	std::lock_guard<std::mutex> guard(_certificate_lock);
+
+	auto contexts = certificates()->contexts();
+	contexts.push_back(std::make_shared<TlsContext>(files, this));
+
+	std::atomic_store(&_certificates, std::shared_ptr<const CertificateSet>(new CertificateSet(std::move(contexts))));
+	_certificate_files.push_back(files);
+	if (_ocsp) _ocsp->set_certificates(certificate_paths());
 }
 
-const TlsContext* Tls::first_ctx() const
+void Tls::reload_certificates()
 {
-	if (_contexts.size() == 0)
+	std::lock_guard<std::mutex> guard(_certificate_lock);
+
+	std::vector<std::shared_ptr<TlsContext>> contexts;
+	for (const auto &files : _certificate_files)
 	{
-		return nullptr;
+		contexts.push_back(std::make_shared<TlsContext>(files, this));
 	}
-	else
+
+	std::atomic_store(&_certificates, std::shared_ptr<const CertificateSet>(new CertificateSet(std::move(contexts))));
+	if (_ocsp) _ocsp->set_certificates(certificate_paths());
+}
+
+std::vector<std::string> Tls::certificate_paths() const
+{
+	std::vector<std::string> paths;
+	for (const auto &files : _certificate_files)
 	{
-		return &_contexts[0];
+		for (const auto &file : files) paths.push_back(file.first);
 	}
+	return paths;
 }
 
-const TlsContext* Tls::get_ctx_for_hostname(const std::string &hostname) const
+void Tls::set_ocsp_stapling(uint32_t refresh)
 {
-	for (const auto &ctx : _contexts)
+	std::lock_guard<std::mutex> guard(_certificate_lock);
+
+	_ocsp.reset();
+	if (refresh)
 	{
-		if (ctx.does_hostname_match(hostname))
+		_ocsp.reset(new OcspStapler(refresh));
+		_ocsp->set_certificates(certificate_paths());
+	}
+}
+
+void Tls::set_groups(const std::string &groups)
+{
+	for (auto &ctx : certificates()->contexts())
+	{
+		if (SSL_CTX_set1_groups_list(ctx->_ctx, groups.c_str()) != 1)
 		{
-			return &ctx;
+			throw tls_error("SSL_CTX_set1_groups_list failed");
 		}
 	}
 
-	return nullptr;
+	_groups = groups;
 }
 
-const TlsContext* Tls::get_ctx_for_hostname(const char* hostname) const
+void Tls::set_ticket_rotation(uint32_t rotation)
 {
-	return get_ctx_for_hostname(std::string(hostname));
+	_tickets_enabled = rotation > 0;
+	if (rotation) _tickets.set_rotation(rotation);
+	for (auto &ctx : certificates()->contexts()) configure_sessions(ctx->_ctx);
 }
 
-const TlsContext* Tls::get_ctx_for_hostname(const char* hostname, size_t hostname_len) const
+void Tls::set_session_cache(size_t capacity)
 {
-	return get_ctx_for_hostname(std::string(hostname, hostname_len));
+	_sessions.reset(capacity ? new SessionCache(capacity) : nullptr);
+	for (auto &ctx : certificates()->contexts()) configure_sessions(ctx->_ctx);
 }
 
-int Tls::alpn_negotiate(SSL *s, unsigned char **out, unsigned char *outlen,
-	const unsigned char *in, unsigned int inlen)
+void Tls::set_record_sizing(size_t small, size_t ramp, uint32_t idle_ms)
 {
-	if (alpn_data.size() == 0)
+	_small_record = small;
+	_record_ramp = ramp;
+	_record_idle = idle_ms;
+}
+
+void Tls::set_early_data(uint32_t max, uint32_t window)
+{
+	_max_early_data = window ? max : 0;
+	_early_data.reset(_max_early_data ? new EarlyDataFilter(window, TLS_EARLY_DATA_TICKETS) : nullptr);
+	for (auto &ctx : certificates()->contexts()) configure_sessions(ctx->_ctx);
+}
+
+// every context resumes the sessions of every other, since sni may pick a different one than
+// the first handshake did
+void Tls::configure_sessions(SSL_CTX *ctx)
+{
+	static const unsigned char session_id_context[] = "myne";
+
+	SSL_CTX_set_app_data(ctx, this);
+	SSL_CTX_set_session_id_context(ctx, session_id_context, sizeof(session_id_context) - 1);
+	SSL_CTX_set_timeout(ctx, _tickets.lifetime());
+
+	if (_tickets_enabled)
 	{
-		if (_handler_mapping.size() == 0)
-		{
-			return SSL_TLSEXT_ERR_NOACK;
-		}
-		else
-		{
-			for (const auto &s : _handler_mapping)
-			{
-				auto &protocol = s.first;
-				if (protocol.size() == 0) continue;
-
-				auto ix = alpn_data.size();
-				unsigned char len = static_cast<unsigned char>(protocol.length());
-				alpn_data.resize(ix + len + 1);
-				alpn_data[ix] = len;
-				memcpy(&alpn_data[ix + 1], &protocol[0], len);
-			}
-		}
+		SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb);
+	}
+	else
+	{
+		SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+	}
+
+	// the built in cache takes a lock per context, ours is sharded
+	if (_sessions)
+	{
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+		SSL_CTX_sess_set_new_cb(ctx, session_new_cb);
+		SSL_CTX_sess_set_get_cb(ctx, session_get_cb);
+		SSL_CTX_sess_set_remove_cb(ctx, session_remove_cb);
+	}
+	else
+	{
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+		SSL_CTX_sess_set_new_cb(ctx, nullptr);
+		SSL_CTX_sess_set_get_cb(ctx, nullptr);
+		SSL_CTX_sess_set_remove_cb(ctx, nullptr);
+	}
+
+	// openssl would only take early data from sessions in its own cache. We filter replays
+	// ourselves so it works with tickets and any number of threads.
+	SSL_CTX_set_max_early_data(ctx, _max_early_data);
+	SSL_CTX_set_recv_max_early_data(ctx, _max_early_data);
+	if (_max_early_data)
+	{
+		SSL_CTX_set_options(ctx, SSL_OP_NO_ANTI_REPLAY);
+		SSL_CTX_set_allow_early_data_cb(ctx, early_data_cb, this);
+	}
+	else
+	{
+		SSL_CTX_clear_options(ctx, SSL_OP_NO_ANTI_REPLAY);
+		SSL_CTX_set_allow_early_data_cb(ctx, nullptr, nullptr);
 	}
+}
+
+std::shared_ptr<TlsContext> Tls::first_ctx() const
+{
+	auto certs = certificates();
+	if (certs->contexts().size() == 0)
+	{
+		return nullptr;
+	}
+	else
+	{
+		return certs->contexts()[0];
+	}
+}
+
+std::shared_ptr<TlsContext> Tls::get_ctx_for_hostname(const std::string &hostname) const
+{
+	return get_ctx_for_hostname(hostname.c_str(), hostname.size());
+}
+
+std::shared_ptr<TlsContext> Tls::get_ctx_for_hostname(const char* hostname) const
+{
+	return get_ctx_for_hostname(hostname, strlen(hostname));
+}
 
+// hostnames are at most 253 characters, so they are lowercased on the stack
+std::shared_ptr<TlsContext> Tls::get_ctx_for_hostname(const char* hostname, size_t hostname_len) const
+{
+	char lower[256];
+	if (hostname_len == 0 || hostname_len >= sizeof(lower)) return nullptr;
+
+	for (size_t i = 0; i < hostname_len; i++)
+	{
+		lower[i] = static_cast<char>(tolower(static_cast<unsigned char>(hostname[i])));
+	}
+
+	return certificates()->find(std::string_view(lower, hostname_len));
+}
+
+int Tls::alpn_negotiate(SSL *s, unsigned char **out, unsigned char *outlen,
+	const unsigned char *in, unsigned int inlen)
+{
 	if (alpn_data.size() != 0)
 	{
 		if (SSL_select_next_proto(out, outlen, &alpn_data[0], static_cast<unsigned int>(alpn_data.size()), in, inlen))
@@ -268,6 +561,22 @@ int Tls::alpn_negotiate(SSL *s, unsigned char **out, unsigned char *outlen,
 	return SSL_TLSEXT_ERR_NOACK;
 }
 
+void Tls::update_alpn()
+{
+	alpn_data.clear();
+	for (const auto &s : _handler_mapping)
+	{
+		auto &protocol = s.first;
+		if (protocol.size() == 0) continue;
+
+		auto ix = alpn_data.size();
+		unsigned char len = static_cast<unsigned char>(protocol.length());
+		alpn_data.resize(ix + len + 1);
+		alpn_data[ix] = len;
+		memcpy(&alpn_data[ix + 1], &protocol[0], len);
+	}
+}
+
 
 std::shared_ptr<SocketEventReceiver> Tls::create_handler(std::string protocol, std::shared_ptr<TlsSocket> socket) const
 {
@@ -284,22 +593,70 @@ std::shared_ptr<SocketEventReceiver> Tls::create_handler(std::string protocol, s
 
 TlsSocket::TlsSocket(std::shared_ptr<Socket> base, const Tls &tls)
 	:_socket(base),
-	_tls(tls)
+	_tls(tls),
+	_rbio(nullptr),
+	_wbio(nullptr),
+	_direct(false),
+	_ktls_send(false),
+	_read_early(false),
+	_early_read(0),
+	_parked(false),
+	_answer_hello(false),
+	_step_done(false),
+	_small_sent(0),
+	_last_write(0),
+	_write_pending(0)
 {
-	_rbio = BIO_new(BIO_s_mem());
-	_wbio = BIO_new(BIO_s_mem());
 	_ssl = SSL_new(tls.first_ctx()->_ctx);
-	if (!_rbio || !_wbio || !_ssl)
+	if (!_ssl)
 	{
 		throw tls_error("failed to initialize ssl");
 	}
 
+	_early = SSL_get_max_early_data(_ssl) > 0;
+
+	// the kernel can only take over connections that openssl reads and writes itself
+	auto fd = tls.ktls() ? base->fd() : -1;
+	if (fd != -1)
+	{
+		if (SSL_set_fd(_ssl, fd) != 1)
+		{
+			SSL_free(_ssl);
+			throw tls_error("failed to attach ssl to socket");
+		}
+
+		_direct = true;
+		SSL_set_mode(_ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef TLS_KTLS
+		SSL_set_options(_ssl, SSL_OP_ENABLE_KTLS);
+#endif
+	}
+	else
+	{
+		_input.reset(new ByteRing(TLS_RING_SIZE));
+		_output.reset(new ByteRing(TLS_RING_SIZE));
+		_rbio = BIO_new_ring(*_input);
+		_wbio = BIO_new_ring(*_output);
+		if (!_rbio || !_wbio)
+		{
+			if (_rbio) BIO_free(_rbio);
+			if (_wbio) BIO_free(_wbio);
+			SSL_free(_ssl);
+			throw tls_error("failed to initialize ssl");
+		}
+
+		SSL_set_bio(_ssl, _rbio, _wbio);
+		SSL_set_mode(_ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	}
+
+	SSL_set_app_data(_ssl, this);
 	SSL_set_accept_state(_ssl);
-	SSL_set_bio(_ssl, _rbio, _wbio);
 }
 
 TlsSocket::~TlsSocket()
 {
+	// a step on the pool holds a reference, so it is done by now
+	_parked = false;
 	close();
 }
 
@@ -307,23 +664,55 @@ ssize_t TlsSocket::read(void* b, size_t max)
 {
 	if (!b || !max || !_ssl) return 0;
 
-	auto amt = SSL_read(_ssl, b, static_cast<int>(max));
-	if (amt == 0)
+	// requests that came as early data go first. Until the handshake is done there is nothing else.
+	if (_early_read == _early_data.size() && !SSL_is_init_finished(_ssl))
 	{
-		// act like a would-block
-		return -1;
+		if (!handshake()) return _ssl ? -1 : 0;
 	}
-	else if (amt < 0)
+	if (_early_read < _early_data.size())
 	{
+		auto amt = std::min(max, _early_data.size() - _early_read);
+		memcpy(b, &_early_data[_early_read], amt);
+		_early_read += amt;
+		if (_early_read == _early_data.size())
+		{
+			_early_data.clear();
+			_early_read = 0;
+		}
+		_read_early = true;
+		return static_cast<ssize_t>(amt);
+	}
+	if (!SSL_is_init_finished(_ssl)) return -1;
+
+	_read_early = false;
+	for (;;)
+	{
+		auto amt = SSL_read(_ssl, b, static_cast<int>(max));
+		if (amt > 0) return amt;
+
 		auto status = SSL_get_error(_ssl, amt);
 
-		if (status == SSL_ERROR_WANT_READ ||
+		if (status == SSL_ERROR_WANT_READ && !_direct)
+		{
+			// openssl wants more than the ring has. Pull it from the socket as it is asked for so
+			// a handler that stops reading leaves the rest on the socket.
+			auto filled = fill();
+			if (filled > 0) continue;
+			return filled;
+		}
+		else if (status == SSL_ERROR_WANT_READ ||
 			status == SSL_ERROR_WANT_WRITE ||
 			status == SSL_ERROR_NONE)
 		{
 			// act like wouldblock
 			return -1;
 		}
+		else if (status == SSL_ERROR_ZERO_RETURN || (status == SSL_ERROR_SYSCALL && _direct && errno == 0))
+		{
+			// the peer closed the connection
+			close();
+			return 0;
+		}
 		else
 		{
 			tlswarning("SSL read error: read from read bio failed\n");
@@ -331,25 +720,102 @@ ssize_t TlsSocket::read(void* b, size_t max)
 			return 0;
 		}
 	}
-
-	return amt;
 }
 
 ssize_t TlsSocket::write(const void* b, size_t amt)
 {
-	if (!b || !amt || !_ssl || !_socket) return 0;
+	iovec iov{ const_cast<void*>(b), amt };
+	return writev(&iov, 1);
+}
+
+// encrypt everything into the output ring first and send it in as few writes as possible
+ssize_t TlsSocket::writev(const iovec* iov, int iovcnt)
+{
+	if (!iov || iovcnt <= 0 || !_ssl || !_socket) return 0;
+
+	// connections that were idle start over with small records. One that is waiting for the
+	// socket to take what it has is stalled, not idle.
+	auto now = coarse_clock();
+	bool waiting = _write_pending > 0 || (!_direct && !_output->empty());
+	if (!waiting && now - _last_write > _tls._record_idle) _small_sent = 0;
+	_last_write = now;
+
+	ssize_t total = 0;
+	for (int i = 0; i < iovcnt; i++)
+	{
+		auto p = static_cast<const char*>(iov[i].iov_base);
+		size_t done = 0;
+		while (done < iov[i].iov_len)
+		{
+			// one call per small record. Openssl splits the rest into full records itself.
+			bool small = _small_sent < _tls._record_ramp && _tls._small_record > 0;
+			auto amt = std::min<size_t>(iov[i].iov_len - done, small ? _tls._small_record : INT_MAX);
+			// openssl fails a retried write that is shorter than the one it holds on to
+			if (_write_pending > amt) amt = std::min(iov[i].iov_len - done, _write_pending);
+			int amtwritten;
+			if (_early)
+			{
+				// answers to early data go out before the handshake is done
+				size_t written = 0;
+				amtwritten = SSL_write_early_data(_ssl, p + done, amt, &written) == 1 ? static_cast<int>(written) : -1;
+			}
+			else
+			{
+				amtwritten = SSL_write(_ssl, p + done, static_cast<int>(amt));
+			}
+
+			if (amtwritten > 0)
+			{
+				done += static_cast<size_t>(amtwritten);
+				total += amtwritten;
+				if (small) _small_sent += static_cast<size_t>(amtwritten);
+				_write_pending = 0;
+				continue;
+			}
+
+			auto status = SSL_get_error(_ssl, amtwritten);
+			if (status == SSL_ERROR_WANT_WRITE) _write_pending = amt;
+
+			if (status == SSL_ERROR_WANT_WRITE && !_direct)
+			{
+				// the ring is full. Carry on if the socket takes some of it.
+				if (!flush()) return 0;
+				if (!_output->full()) continue;
+			}
+
+			if (status == SSL_ERROR_WANT_READ ||
+				status == SSL_ERROR_WANT_WRITE ||
+				status == SSL_ERROR_NONE)
+			{
+				// act like wouldblock
+				return total > 0 ? total : -1;
+			}
+			else
+			{
+				tlswarning("SSL write error: failed to fill write BIO\n");
+				close();
+				return 0;
+			}
+		}
+	}
+
+	if (!_direct && !flush()) return 0;
+	return total;
+}
 
-	auto amtwritten = SSL_write(_ssl, b, static_cast<int>(amt));
+ssize_t TlsSocket::sendfile(int fd, off_t offset, size_t count)
+{
+	if (!_ktls_send) return Socket::sendfile(fd, offset, count);
+	if (!_ssl || !_socket) return 0;
 
-	if (amtwritten > 0)
+	auto amt = SSL_sendfile(_ssl, fd, offset, count, 0);
+	if (amt > 0)
 	{
-		// force the socket to write even if it may not be possible
-		write_avail();
-		return amtwritten;
+		return amt;
 	}
 	else
 	{
-		auto status = SSL_get_error(_ssl, amtwritten);
+		auto status = SSL_get_error(_ssl, static_cast<int>(amt));
 
 		if (status == SSL_ERROR_WANT_READ ||
 			status == SSL_ERROR_WANT_WRITE ||
@@ -360,7 +826,7 @@ ssize_t TlsSocket::write(const void* b, size_t amt)
 		}
 		else
 		{
-			tlswarning("SSL read error: failed to fill write BIO\n");
+			tlswarning("SSL write error: sendfile failed\n");
 			close();
 			return 0;
 		}
@@ -369,154 +835,249 @@ ssize_t TlsSocket::write(const void* b, size_t amt)
 
 void TlsSocket::close()
 {
-	if (_ssl) { SSL_free(_ssl); _rbio = _wbio = nullptr; _ssl = nullptr; }
+	// the ssl is freed with us if a pool thread still uses it
+	if (_ssl && !busy())
+	{
+		// saying goodbye keeps the session resumable. Openssl drops sessions of connections
+		// that broke.
+		if (_socket && SSL_is_init_finished(_ssl) && SSL_shutdown(_ssl) >= 0 && !_direct)
+		{
+			iovec iov[2];
+			auto n = _output->data(iov);
+			if (n > 0) _socket->writev(iov, n);
+		}
+
+		SSL_free(_ssl);
+		_rbio = _wbio = nullptr;
+		_ssl = nullptr;
+	}
 	if (_socket) { _socket->close(); _socket.reset(); }
 	signal_closed();
 }
 
+void TlsSocket::set_deadline(Deadline deadline)
+{
+	if (_socket) _socket->set_deadline(deadline);
+}
+
 void TlsSocket::read_avail()
 {
-	if (!_ssl || !_socket) return;
+	if (!_ssl || !_socket || busy()) return;
 
-	for (;;)
-	{
-		char buf[4096];
+	if (!handshake()) return;
 
-		auto amt = socket_read(buf, sizeof(buf));
+	signal_read_avail();
+	signal_write_avail();
 
-		if (amt <= 0)
+	// anything openssl wrote by itself, like alerts
+	if (!_direct) flush();
+}
+
+void TlsSocket::write_avail()
+{
+	if (!_ssl || !_socket || busy()) return;
+
+	// send what is waiting in the ring. Whoever was waiting for room can go on after.
+	if (!_direct && !flush()) return;
+
+	bool connected = _connection != nullptr;
+	if (!handshake()) return;
+
+	if (!connected) signal_read_avail();
+	signal_write_avail();
+}
+
+// drive the handshake. Returns true once connected to a handler, which is when the handshake is
+// done or when the client sent early data that was accepted.
+bool TlsSocket::handshake()
+{
+	// early data comes right after the client hello. Keep it for the handler.
+	while (_early)
+	{
+		auto offset = _early_data.size();
+		_early_data.resize(offset + TLS_EARLY_DATA_CHUNK);
+		size_t amt = 0;
+		auto r = SSL_read_early_data(_ssl, &_early_data[offset], TLS_EARLY_DATA_CHUNK, &amt);
+		_early_data.resize(offset + amt);
+		if (!_direct && !flush()) return false;
+
+		if (r == SSL_READ_EARLY_DATA_SUCCESS) continue;
+		if (r == SSL_READ_EARLY_DATA_FINISH)
 		{
-			// no data available
+			_early = false;
 			break;
 		}
-		else if (amt > 0)
-		{
-			char* p = buf;
-			while (amt > 0)
-			{
-				auto consumed = BIO_write(_rbio, p, static_cast<int>(amt));
-				if (consumed < 0)
-				{
-					tlswarning("SSL read error: BIO write to read bio failed\n");
-					close();
-					return;
-				}
-				else if (consumed == 0 && amt > 0)
-				{
-					tlswarning("SSL read error: failed to fill read BIO\n");
-					close();
-					return;
-				}
 
-				p += consumed;
-				amt -= consumed;
-			}
+		auto status = SSL_get_error(_ssl, -1);
+
+		if (status == SSL_ERROR_WANT_CLIENT_HELLO_CB)
+		{
+			if (offload()) return false;
+			continue;
+		}
+		else if (status == SSL_ERROR_WANT_READ && !_direct && fill() > 0)
+		{
+			continue;
+		}
+		else if (status == SSL_ERROR_WANT_WRITE && !_direct && !_output->full())
+		{
+			continue;
+		}
+		else if (status == SSL_ERROR_WANT_WRITE || status == SSL_ERROR_WANT_READ)
+		{
+			// the handler can start on what it got while the client finishes the handshake
+			if (!_early_data.empty() && !_connection) connect();
+			return _connection != nullptr;
 		}
 		else
 		{
-			// socket broken
+			tlswarning("SSL read error: could not read early data");
 			close();
-			return;
+			return false;
 		}
 	}
 
 	// SSL state machine
-	if (!SSL_is_init_finished(_ssl))
+	auto finished = SSL_is_init_finished(_ssl);
+	while (!SSL_is_init_finished(_ssl))
 	{
 		auto r = SSL_accept(_ssl);
-		if (r <= 0)
-		{
-			auto status = SSL_get_error(_ssl, r);
+		if (!_direct && !flush()) return false;
+		if (r > 0) break;
 
-			if (status == SSL_ERROR_WANT_WRITE || status == SSL_ERROR_WANT_READ)
-			{
-				// will write on next write cycle
-				return;
-			}
-			else
-			{
-				tlswarning("SSL read error: unexpected result from accept");
-				close();
-				return;
-			}
+		auto status = SSL_get_error(_ssl, r);
+
+		if (status == SSL_ERROR_WANT_CLIENT_HELLO_CB)
+		{
+			if (offload()) return false;
+			continue;
+		}
+		else if (status == SSL_ERROR_WANT_READ && !_direct)
+		{
+			// the rest of the handshake may already be on the socket
+			if (fill() > 0) continue;
+			return _connection != nullptr;
+		}
+		else if (status == SSL_ERROR_WANT_WRITE && !_direct && !_output->full())
+		{
+			continue;
+		}
+		else if (status == SSL_ERROR_WANT_WRITE || status == SSL_ERROR_WANT_READ)
+		{
+			// will write on next write cycle
+			return _connection != nullptr;
+		}
+		else
+		{
+			tlswarning("SSL read error: unexpected result from accept");
+			close();
+			return false;
 		}
 	}
 
-	// connect to the appropriate handler once init is finished
-	if (!_connection)
+#ifdef TLS_KTLS
+	// see whether the kernel took over encrypting
+	if (!finished && _direct) _ktls_send = BIO_get_ktls_send(SSL_get_wbio(_ssl)) > 0;
+#else
+	(void)finished;
+#endif
+
+	if (!_connection) connect();
+	return _connection != nullptr;
+}
+
+// whether to stop the handshake at a client hello so a pool thread answers it. That is where the
+// expensive parts are, like the key exchange and signing.
+bool TlsSocket::offload_hello()
+{
+	if (_answer_hello)
 	{
-		if (SSL_is_init_finished(_ssl))
-		{
-			auto shared_me = _myself.lock();
-			if (shared_me)
-			{
-				unsigned char* proto = nullptr;
-				unsigned int len;
-				SSL_get0_alpn_selected(_ssl, const_cast<const unsigned char**>(&proto), &len);
-				if (len)
-				{
-					std::string sproto(reinterpret_cast<char*>(proto), len);
-					_connection = _tls.create_handler(sproto, shared_me);
-				}
-				else
-				{
-					close();
-				}
-			}
-			else
-			{
-				close();
-			}
-		}
+		_answer_hello = false;
+		return false;
 	}
 
-	if (_connection)
+	return _tls._handshake_pool && !_direct && _socket && _socket->can_wake();
+}
+
+// hand the client hello the handshake stopped at to the pool. Returns true if the handshake has to
+// wait for it, false if it should go on here.
+bool TlsSocket::offload()
+{
+	auto self = _myself.lock();
+	_answer_hello = true;
+	if (!self) return false;
+
+	// only the pool touches the ssl and the rings until it is done. It wakes us up after.
+	auto socket = _socket;
+	_step_done.store(false, std::memory_order_relaxed);
+	_parked = _tls._handshake_pool->submit([self, socket]()
+	{
+		self->handshake_step();
+		self->_step_done.store(true, std::memory_order_release);
+		socket->wake();
+	});
+
+	// a busy pool leaves it to us
+	return _parked;
+}
+
+// runs on a pool thread
+void TlsSocket::handshake_step()
+{
+	ERR_clear_error();
+	if (_early)
 	{
-		signal_read_avail();
-		signal_write_avail();
+		auto offset = _early_data.size();
+		_early_data.resize(offset + TLS_EARLY_DATA_CHUNK);
+		size_t amt = 0;
+		auto r = SSL_read_early_data(_ssl, &_early_data[offset], TLS_EARLY_DATA_CHUNK, &amt);
+		_early_data.resize(offset + amt);
+		if (r == SSL_READ_EARLY_DATA_FINISH) _early = false;
 	}
+	else
+	{
+		SSL_accept(_ssl);
+	}
+
+	// the event loop picks up where this left off. If this failed, that fails too.
+	ERR_clear_error();
 }
 
-void TlsSocket::write_avail()
+// whether a handshake step is still on the pool
+bool TlsSocket::busy()
+{
+	if (_parked && _step_done.load(std::memory_order_acquire)) _parked = false;
+	return _parked;
+}
+
+// connect to the handler for the protocol alpn picked
+void TlsSocket::connect()
 {
-	if (!_ssl || !_socket) return;
+	_tls._handshakes.fetch_add(1, std::memory_order_relaxed);
+	if (SSL_session_reused(_ssl)) _tls._resumptions.fetch_add(1, std::memory_order_relaxed);
 
-	bool wouldblock;
-	size_t amt_avail;
-	do
+	auto shared_me = _myself.lock();
+	if (shared_me)
 	{
-		// write as much data as we can from what's available in the write BIO
-		void* ptr;
-		amt_avail = BIO_get_mem_data(_wbio, &ptr);
-		if (amt_avail > 0)
-		{
-			auto amount_written = _socket->write(ptr, amt_avail);
-			if (amount_written > 0)
-			{
-				BIO_advance(_wbio, amount_written);
-			}
-			else if (amount_written == 0)
-			{
-				close();
-				return;
-			}
-			else
-			{
-				wouldblock = true;
-			}
-		}
-		else if (amt_avail == 0)
+		unsigned char* proto = nullptr;
+		unsigned int len;
+		SSL_get0_alpn_selected(_ssl, const_cast<const unsigned char**>(&proto), &len);
+
+		// clients that do not do alpn get the default handler, if there is one
+		std::string sproto(len ? reinterpret_cast<char*>(proto) : "", len);
+		if (len || _tls._handler_mapping.count(sproto))
 		{
-			wouldblock = false;
-			break;
+			_connection = _tls.create_handler(sproto, shared_me);
 		}
 		else
 		{
-			tlswarning("SSL read error: BIO read from write bio failed\n");
 			close();
-			return;
 		}
-	} while (!wouldblock || amt_avail > 0);
+	}
+	else
+	{
+		close();
+	}
 }
 
 void TlsSocket::closed()
@@ -524,29 +1085,70 @@ void TlsSocket::closed()
 	close();
 }
 
-ssize_t TlsSocket::socket_read(void* b, size_t a)
+// read from the socket straight into the input ring. Returns what was read, 0 if the connection
+// closed or -1 if the socket had nothing.
+ssize_t TlsSocket::fill()
 {
-	return _socket ? _socket->read(b, a) : 0;
+	if (!_socket) return 0;
+
+	auto span = _input->free_span();
+	if (span.iov_len == 0) return -1;
+
+	auto amt = _socket->read(span.iov_base, span.iov_len);
+	if (amt == 0)
+	{
+		close();
+		return 0;
+	}
+	else if (amt > 0)
+	{
+		_input->commit(static_cast<size_t>(amt));
+	}
+
+	return amt;
 }
 
-ssize_t TlsSocket::socket_write(void* b, size_t a)
+// write what is in the output ring straight to the socket, until it is empty or the socket is
+// full. Returns false if the connection closed.
+bool TlsSocket::flush()
 {
-	return _socket ? _socket->write(b, a) : 0;
+	while (_socket && !_output->empty())
+	{
+		iovec iov[2];
+		auto n = _output->data(iov);
+		auto amt = _socket->writev(iov, n);
+		if (amt == 0)
+		{
+			close();
+			return false;
+		}
+		else if (amt < 0)
+		{
+			break;
+		}
+
+		_output->consume(static_cast<size_t>(amt));
+	}
+
+	return _socket != nullptr;
 }
 
+// the handler may close us, and so let go of itself, while it handles an event
 void TlsSocket::signal_read_avail()
 {
-	if (_connection)
+	auto connection = _connection;
+	if (connection)
 	{
-		_connection->read_avail();
+		connection->read_avail();
 	}
 }
 
 void TlsSocket::signal_write_avail()
 {
-	if (_connection)
+	auto connection = _connection;
+	if (connection)
 	{
-		_connection->write_avail();
+		connection->write_avail();
 	}
 }
 
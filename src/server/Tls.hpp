@@ -1,7 +1,25 @@
 #pragma once
+#include "ByteRing.hpp"
+#include "TlsSessions.hpp"
+#include "TlsOcsp.hpp"
+#include "WorkerPool.hpp"
 
-static constexpr auto SSL_PROTOCOL_FLAGS = SSL_OP_ALL | SSL_OP_NO_SSLv3 | SSL_OP_NO_TLSv1 | SSL_OP_NO_TLSv1_1 | SSL_OP_NO_COMPRESSION | SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION;
-static constexpr auto SSL_CIPHER_LIST = "ECDH+AESGCM:ECDH+CHACHA20:ECDH+AES256:ECDH+AES128:!aNULL:!MD5:!DSS:!SHA1:!AESCCM:!DHE:!RSA";
+static constexpr auto SSL_PROTOCOL_FLAGS = SSL_OP_ALL | SSL_OP_NO_SSLv3 | SSL_OP_NO_TLSv1 | SSL_OP_NO_TLSv1_1 | SSL_OP_NO_COMPRESSION | SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF
+	| SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_PRIORITIZE_CHACHA;
+// ecdsa suites first so that hosts with an ecdsa and an rsa certificate sign with the cheaper one
+static constexpr auto SSL_CIPHER_LIST = "ECDH+AESGCM+aECDSA:ECDH+CHACHA20+aECDSA:ECDH+AESGCM:ECDH+CHACHA20:ECDH+AES256:ECDH+AES128:!aNULL:!MD5:!DSS:!SHA1:!AESCCM:!DHE:!kRSA";
+static constexpr auto TLS13_CIPHER_SUITES = "TLS_AES_128_GCM_SHA256:TLS_CHACHA20_POLY1305_SHA256:TLS_AES_256_GCM_SHA384";
+// key exchange groups, most preferred first
+static constexpr auto TLS_GROUPS = "X25519:P-256:P-384";
+
+// the most a record may carry so it fits one tcp segment, with room for ipv6, tcp options and the
+// record overhead
+static constexpr size_t TLS_SMALL_RECORD = 1369;
+
+// kernel tls needs openssl 3 built with ktls support
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define TLS_KTLS 1
+#endif
 
 
 std::string get_tls_error_string();
@@ -19,19 +37,19 @@ class TlsSocket;
 class TlsContext
 {
 public:
-	TlsContext(const char* certificate, const char* key, Tls *tls);
+	// files are pairs of certificate and key for the same names, one for each type of key
+	TlsContext(const std::vector<std::pair<std::string, std::string>> &files, Tls *tls);
 	~TlsContext();
 	TlsContext(const TlsContext &) = delete;
 	TlsContext& operator=(const TlsContext&) = delete;
-	TlsContext(TlsContext &&);
 
-	bool does_hostname_match(const std::string &hostname) const;
+	// the names on the certificate, lowercase. Wildcards start with *.
+	inline const std::vector<std::string> &hostnames() const { return _hostnames; }
 
 private:
 
 	Tls *_tls;
 	SSL_CTX* _ctx;
-	X509* _cert;
 	std::vector<std::string> _hostnames;
 
 	friend class Tls;
@@ -39,6 +57,28 @@ private:
 	friend int ssl_servername_cb(SSL *s, int *ad, Tls *ctx);
 };
 
+// the certificates served at one point in time, indexed by hostname. Never changes once made.
+// Reloading makes a new set, and handshakes still using the old one keep it alive.
+class CertificateSet
+{
+public:
+	CertificateSet(std::vector<std::shared_ptr<TlsContext>> contexts);
+	CertificateSet(const CertificateSet&) = delete;
+	CertificateSet& operator=(const CertificateSet&) = delete;
+
+	inline const std::vector<std::shared_ptr<TlsContext>> &contexts() const { return _contexts; }
+
+	// the context for a lowercase hostname. A name on a certificate matches before a wildcard,
+	// which matches one label, and certificates added first before later ones.
+	std::shared_ptr<TlsContext> find(std::string_view hostname) const;
+
+private:
+	std::vector<std::shared_ptr<TlsContext>> _contexts;
+	// indexes into _contexts. Wildcards are keyed by what follows the *.
+	std::unordered_map<std::string_view, size_t> _names;
+	std::unordered_map<std::string_view, size_t> _wildcards;
+};
+
 class Tls
 {
 public:
@@ -50,6 +90,61 @@ public:
 
 	void add_certificate(const char* certificate, const char* key);
 
+	// serve a host with a certificate for each type of key, for example an ecdsa one and an rsa
+	// one for clients that can't verify ecdsa. Clients that can get the ecdsa one.
+	void add_certificate(const std::vector<std::pair<std::string, std::string>> &files);
+
+	// load all certificates again from their files and serve them from then on. Handshakes in
+	// progress finish with the ones they started with. Throws, keeping the old ones, if any of
+	// them can't be loaded.
+	void reload_certificates();
+
+	// the certificates served right now
+	inline std::shared_ptr<const CertificateSet> certificates() const { return std::atomic_load(&_certificates); }
+
+	// let the kernel do the encryption of connections that have a socket of their own. Connections
+	// then talk to the socket directly and fall back to encrypting in user space if the kernel or
+	// the negotiated cipher do not support it.
+	inline void set_ktls(bool enable) { _ktls = enable; }
+	inline bool ktls() const { return _ktls; }
+
+	// staple ocsp responses from a .ocsp file next to each certificate, which are read again every
+	// refresh seconds. 0 turns stapling off.
+	void set_ocsp_stapling(uint32_t refresh);
+
+	// the key exchange groups offered, most preferred first, as an openssl groups list. Throws if
+	// openssl doesn't know one of them.
+	void set_groups(const std::string &groups);
+
+	// session tickets are encrypted with keys shared by all contexts and replaced every rotation
+	// seconds. 0 turns tickets off.
+	void set_ticket_rotation(uint32_t rotation);
+
+	// keep up to capacity sessions for clients that resume by session id instead of a ticket.
+	// 0 turns the cache off.
+	void set_session_cache(size_t capacity);
+
+	// accept up to max bytes of early data from resuming tls 1.3 clients whose ticket is at most
+	// window seconds old. Requests in it are answered before the handshake is done, if they are
+	// safe to replay. 0 turns early data off.
+	void set_early_data(uint32_t max, uint32_t window = 600);
+
+	// send records of at most small bytes until a connection sent ramp bytes, and again after it
+	// was idle for idle_ms. A browser can decrypt the first packets of a response as they come in
+	// instead of waiting for a whole 16KB record. Full records cost less, so bulk transfers
+	// switch to those. A small of 0 always sends full records.
+	void set_record_sizing(size_t small, size_t ramp = 64 * 1024, uint32_t idle_ms = 1000);
+
+	// answer client hellos on the threads of a pool instead of the event loop, which then goes on
+	// with other connections while the keys are worked out and signed. Only for connections that
+	// are not encrypted by the kernel. The pool must outlive the acceptors, and be stopped while
+	// they still run so the handshakes it finishes can wake their connections.
+	inline void set_handshake_pool(WorkerPool *pool) { _handshake_pool = pool; }
+
+	// handshakes completed, and how many of them resumed an earlier session
+	inline uint64_t handshakes() const { return _handshakes.load(std::memory_order_relaxed); }
+	inline uint64_t resumptions() const { return _resumptions.load(std::memory_order_relaxed); }
+
 	inline void add_handler(std::function<std::shared_ptr<SocketEventReceiver>(std::shared_ptr<TlsSocket> socket)> factory)
 	{
 		_handler_mapping.insert_or_assign(std::string(), factory);
@@ -58,23 +153,55 @@ public:
 	inline void add_handler(std::string protocol, std::function<std::shared_ptr<SocketEventReceiver>(std::shared_ptr<TlsSocket> socket)> factory)
 	{
 		_handler_mapping.insert_or_assign(protocol, factory);
+		update_alpn();
 	}
 
-	const TlsContext* first_ctx() const;
-	const TlsContext* get_ctx_for_hostname(const std::string &hostname) const;
-	const TlsContext* get_ctx_for_hostname(const char* hostname) const;
-	const TlsContext* get_ctx_for_hostname(const char* hostname, size_t hostname_len) const;
+	std::shared_ptr<TlsContext> first_ctx() const;
+	std::shared_ptr<TlsContext> get_ctx_for_hostname(const std::string &hostname) const;
+	std::shared_ptr<TlsContext> get_ctx_for_hostname(const char* hostname) const;
+	std::shared_ptr<TlsContext> get_ctx_for_hostname(const char* hostname, size_t hostname_len) const;
 private:
 	int alpn_negotiate(SSL *s, unsigned char **out, unsigned char *outlen,
 		const unsigned char *in, unsigned int inlen);
+	void update_alpn();
 
 	std::shared_ptr<SocketEventReceiver> create_handler(std::string protocol, std::shared_ptr<TlsSocket> socket) const;
+	void configure_sessions(SSL_CTX *ctx);
+	std::vector<std::string> certificate_paths() const;
 
-	std::vector<TlsContext> _contexts;
+	// replaced as a whole so handshakes can read it without locking
+	std::shared_ptr<const CertificateSet> _certificates;
+	// the certificate and key files, to reload from. Changes are serialized by the lock.
+	std::vector<std::vector<std::pair<std::string, std::string>>> _certificate_files;
+	std::mutex _certificate_lock;
 	std::unordered_map<std::string, std::function<std::shared_ptr<SocketEventReceiver>(std::shared_ptr<TlsSocket> socket)>> _handler_mapping;
+	// the protocols offered in alpn. Built as handlers are added, before any handshake, since
+	// handshakes read it on many threads at once.
 	std::vector<unsigned char> alpn_data;
+	bool _ktls = false;
+	std::string _groups = TLS_GROUPS;
+
+	bool _tickets_enabled = true;
+	TicketKeys _tickets;
+	std::unique_ptr<SessionCache> _sessions;
+	uint32_t _max_early_data = 0;
+	std::unique_ptr<EarlyDataFilter> _early_data;
+	WorkerPool *_handshake_pool = nullptr;
+	std::unique_ptr<OcspStapler> _ocsp;
+	size_t _small_record = TLS_SMALL_RECORD;
+	size_t _record_ramp = 64 * 1024;
+	uint32_t _record_idle = 1000;
+	mutable std::atomic<uint64_t> _handshakes;
+	mutable std::atomic<uint64_t> _resumptions;
 
+	friend class TlsContext;
 	friend class TlsSocket;
+	friend int ticket_key_cb(SSL *s, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc);
+	friend int session_new_cb(SSL *s, SSL_SESSION *session);
+	friend SSL_SESSION *session_get_cb(SSL *s, const unsigned char *id, int idlen, int *copy);
+	friend void session_remove_cb(SSL_CTX *ctx, SSL_SESSION *session);
+	friend int early_data_cb(SSL *s, void *arg);
+	friend int ocsp_status_cb(SSL *s, void *arg);
 	friend int alpn_cb(SSL *s, const unsigned char **out, unsigned char *outlen,
 		const unsigned char *in, unsigned int inlen, void *usr);
 };
@@ -87,7 +214,12 @@ public:
 
 	virtual ssize_t read(void* b, size_t max) override;
 	virtual ssize_t write(const void* b, size_t amt) override;
+	virtual ssize_t writev(const iovec* iov, int iovcnt) override;
+	virtual bool can_sendfile() const override { return _ktls_send; }
+	virtual ssize_t sendfile(int fd, off_t offset, size_t count) override;
 	virtual void close() override;
+	virtual void set_deadline(Deadline deadline) override;
+	virtual bool early_data() const override { return _read_early; }
 
 	virtual void read_avail() override;
 	virtual void write_avail() override;
@@ -101,8 +233,16 @@ private:
 
 	std::weak_ptr<TlsSocket> _myself;
 
-	ssize_t socket_read(void* b, size_t a);
-	ssize_t socket_write(void* b, size_t a);
+	ssize_t fill();
+	bool flush();
+	bool handshake();
+	void connect();
+	bool offload_hello();
+	bool offload();
+	void handshake_step();
+	bool busy();
+
+	friend int client_hello_cb(SSL *s, int *al, void *arg);
 
 	void signal_read_avail();
 	void signal_write_avail();
@@ -111,6 +251,30 @@ private:
 	SSL* _ssl;
 	BIO *_rbio;
 	BIO *_wbio;
+	// what was received and what is to be sent, while openssl is not talking to the socket itself
+	std::unique_ptr<ByteRing> _input;
+	std::unique_ptr<ByteRing> _output;
+	// reading and writing the socket directly instead of through the memory BIOs
+	bool _direct;
+	// the kernel encrypts what we send
+	bool _ktls_send;
+	// the client may still send early data
+	bool _early;
+	// the handler last read early data
+	bool _read_early;
+	// early data the handler did not read yet
+	std::vector<char> _early_data;
+	size_t _early_read;
+	// a handshake step was handed to the pool, and it is done with it
+	bool _parked;
+	// the next client hello is answered right away instead of handed to the pool
+	bool _answer_hello;
+	std::atomic<bool> _step_done;
+	// sent in small records since the connection started or was idle, and when it last sent
+	size_t _small_sent;
+	uint64_t _last_write;
+	// length of the write openssl stopped in the middle of. Retries may not be shorter.
+	size_t _write_pending;
 
 	std::shared_ptr<SocketEventReceiver> _connection;
 };
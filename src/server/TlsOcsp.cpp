@@ -0,0 +1,183 @@
+#include "pch.hpp"
+#include "TlsOcsp.hpp"
+
+
+static std::string fingerprint(X509 *cert)
+{
+	// openssl keeps the sha-1 of a certificate, so this doesn't hash it again
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int len = 0;
+	if (X509_digest(cert, EVP_sha1(), md, &len) != 1) return std::string();
+	return std::string(reinterpret_cast<char*>(md), len);
+}
+
+// check that the response is a good one for the certificate and convert it. Returns a reason if not.
+static const char *check_response(X509 *cert, OCSP_RESPONSE *resp, std::vector<unsigned char> &der, time_t &next_update)
+{
+	if (OCSP_response_status(resp) != OCSP_RESPONSE_STATUS_SUCCESSFUL) return "unsuccessful response";
+
+	auto basic = OCSP_response_get1_basic(resp);
+	if (!basic) return "no basic response";
+
+	// the signature can't be checked without the issuer, which isn't configured. Clients check it.
+	const char *reason = "certificate not in response";
+	auto serial = X509_get0_serialNumber(cert);
+	for (int i = 0; i < OCSP_resp_count(basic); i++)
+	{
+		auto single = OCSP_resp_get0(basic, i);
+		ASN1_INTEGER *single_serial = nullptr;
+		OCSP_id_get0_info(nullptr, nullptr, nullptr, &single_serial, const_cast<OCSP_CERTID*>(OCSP_SINGLERESP_get0_id(single)));
+		if (!single_serial || ASN1_INTEGER_cmp(serial, single_serial) != 0) continue;
+
+		int cause;
+		ASN1_GENERALIZEDTIME *revoked, *this_update, *next;
+		auto status = OCSP_single_get0_status(single, &cause, &revoked, &this_update, &next);
+		if (status != V_OCSP_CERTSTATUS_GOOD)
+		{
+			reason = "certificate not good";
+		}
+		else if (OCSP_check_validity(this_update, next, 300, -1) != 1)
+		{
+			reason = "response expired";
+		}
+		else
+		{
+			int days = 0, seconds = 0;
+			next_update = next && ASN1_TIME_diff(&days, &seconds, nullptr, next)
+				? time(nullptr) + days * 86400 + seconds
+				: 0;
+			reason = nullptr;
+		}
+		break;
+	}
+	OCSP_BASICRESP_free(basic);
+	if (reason) return reason;
+
+	auto len = i2d_OCSP_RESPONSE(resp, nullptr);
+	if (len <= 0) return "could not encode response";
+	der.resize(len);
+	auto p = der.data();
+	i2d_OCSP_RESPONSE(resp, &p);
+	return nullptr;
+}
+
+
+// OcspStapler
+
+OcspStapler::OcspStapler(uint32_t refresh)
+	: _responses(std::make_shared<responses>()), _dirty(false), _running(true), _refresh(refresh ? refresh : 1)
+{
+	_thread = std::thread([this]() { refresher(); });
+}
+
+OcspStapler::~OcspStapler()
+{
+	stop();
+}
+
+void OcspStapler::set_certificates(std::vector<std::string> certificates)
+{
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		_certificates = std::move(certificates);
+		_dirty = true;
+	}
+
+	_changed.notify_one();
+}
+
+bool OcspStapler::staple(SSL *s) const
+{
+	auto cert = SSL_get_certificate(s);
+	if (!cert) return false;
+
+	auto current = std::atomic_load(&_responses);
+	auto found = current->find(fingerprint(cert));
+	if (found == current->end()) return false;
+
+	auto &r = found->second;
+	if (r.next_update && time(nullptr) >= r.next_update) return false;
+
+	// openssl frees it once it is sent
+	auto der = static_cast<unsigned char*>(OPENSSL_malloc(r.der.size()));
+	if (!der) return false;
+	memcpy(der, r.der.data(), r.der.size());
+	SSL_set_tlsext_status_ocsp_resp(s, der, static_cast<long>(r.der.size()));
+	return true;
+}
+
+void OcspStapler::stop()
+{
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		_running = false;
+	}
+
+	_changed.notify_all();
+	if (_thread.joinable()) _thread.join();
+}
+
+void OcspStapler::refresher()
+{
+	std::unique_lock<std::mutex> guard(_lock);
+	while (_running)
+	{
+		auto certificates = _certificates;
+		_dirty = false;
+
+		guard.unlock();
+		try
+		{
+			refresh(certificates);
+		}
+		catch (std::exception &e)
+		{
+			error("Exception refreshing ocsp responses: %s\n", e.what());
+		}
+		guard.lock();
+
+		_changed.wait_for(guard, std::chrono::seconds(_refresh), [this]() { return !_running || _dirty; });
+	}
+}
+
+void OcspStapler::refresh(const std::vector<std::string> &certificates)
+{
+	auto next = std::make_shared<responses>();
+	for (const auto &certificate : certificates)
+	{
+		auto bio = BIO_new_file(certificate.c_str(), "r");
+		auto cert = bio ? PEM_read_bio_X509_AUX(bio, nullptr, nullptr, nullptr) : nullptr;
+		BIO_free(bio);
+		if (!cert)
+		{
+			ERR_clear_error();
+			continue;
+		}
+
+		// no file just means nothing to staple
+		auto path = certificate + ".ocsp";
+		bio = BIO_new_file(path.c_str(), "rb");
+		auto exists = bio != nullptr;
+		auto resp = exists ? d2i_OCSP_RESPONSE_bio(bio, nullptr) : nullptr;
+		BIO_free(bio);
+		if (!exists) ERR_clear_error();
+
+		if (exists && !resp)
+		{
+			warning("ignoring ocsp response %s: could not parse it\n", path.c_str());
+			ERR_clear_error();
+		}
+		else if (resp)
+		{
+			response r;
+			auto reason = check_response(cert, resp, r.der, r.next_update);
+			if (reason) warning("ignoring ocsp response %s: %s\n", path.c_str(), reason);
+			else next->insert_or_assign(fingerprint(cert), std::move(r));
+			OCSP_RESPONSE_free(resp);
+		}
+
+		X509_free(cert);
+	}
+
+	std::atomic_store(&_responses, std::shared_ptr<const responses>(std::move(next)));
+}
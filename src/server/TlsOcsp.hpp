@@ -0,0 +1,51 @@
+#pragma once
+
+// for the atomic functions on shared_ptr that _responses is published with
+#include <memory>
+
+// keeps the ocsp responses that are stapled to handshakes in memory. A thread of its own reads
+// them from a file next to each certificate, named like it with .ocsp appended and in DER as
+// openssl ocsp -respout writes them. It reads them again every refresh interval and when the
+// certificates change, so handshakes only ever look them up.
+class OcspStapler
+{
+public:
+	OcspStapler(uint32_t refresh = 3600);
+	~OcspStapler();
+	OcspStapler(const OcspStapler&) = delete;
+	OcspStapler& operator=(const OcspStapler&) = delete;
+
+	// the certificate files to staple responses for. Their responses are read soon after.
+	void set_certificates(std::vector<std::string> certificates);
+
+	// staple the response for the certificate the handshake uses. Returns false if there is no
+	// valid one.
+	bool staple(SSL *s) const;
+
+	// stop the thread. Responses read so far are still stapled.
+	void stop();
+
+private:
+	struct response
+	{
+		std::vector<unsigned char> der;
+		// when the responder said it may be replaced by a newer one, or 0 if it didn't say
+		time_t next_update;
+	};
+	// by the sha-1 fingerprint of the certificate
+	using responses = std::unordered_map<std::string, response>;
+
+	void refresher();
+	void refresh(const std::vector<std::string> &certificates);
+
+	// replaced as a whole so handshakes can read it without locking
+	std::shared_ptr<const responses> _responses;
+
+	std::mutex _lock;
+	std::condition_variable _changed;
+	std::vector<std::string> _certificates;
+	bool _dirty;
+	bool _running;
+	uint32_t _refresh;
+	std::thread _thread;
+};
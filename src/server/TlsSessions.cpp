@@ -0,0 +1,220 @@
+#include "pch.hpp"
+#include "Listener.hpp"
+#include "Tls.hpp"
+
+
+// TicketKeys
+
+TicketKeys::TicketKeys(uint32_t rotation)
+	: _rotation(rotation ? rotation : 1)
+{
+	memset(_keys, 0, sizeof(_keys));
+}
+
+TicketKeys::~TicketKeys()
+{
+	OPENSSL_cleanse(_keys, sizeof(_keys));
+}
+
+void TicketKeys::set_rotation(uint32_t rotation)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	_rotation = rotation ? rotation : 1;
+}
+
+// make new keys for the rotations that passed since the newest key was made
+void TicketKeys::rotate(time_t now)
+{
+	auto elapsed = _keys[0].created ? now - _keys[0].created : static_cast<time_t>(_rotation) * KEYS;
+	if (elapsed < _rotation) return;
+
+	auto steps = std::min<time_t>(elapsed / _rotation, KEYS);
+	for (time_t i = 0; i < steps; i++)
+	{
+		for (size_t k = KEYS - 1; k > 0; k--) _keys[k] = _keys[k - 1];
+		_keys[0].created = 0;
+	}
+
+	auto &k = _keys[0];
+	if (RAND_bytes(k.name, sizeof(k.name)) != 1 ||
+		RAND_bytes(k.aes, sizeof(k.aes)) != 1 ||
+		RAND_bytes(k.hmac, sizeof(k.hmac)) != 1)
+	{
+		throw tls_error("could not make ticket key");
+	}
+	k.created = now;
+}
+
+int TicketKeys::crypt(unsigned char name[16], unsigned char *iv, EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc)
+{
+	key k;
+	bool newest = true;
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		try
+		{
+			rotate(time(nullptr));
+		}
+		catch (tls_error &e)
+		{
+			warning("%s\n", e.what());
+			return enc ? -1 : 0;
+		}
+
+		if (enc)
+		{
+			k = _keys[0];
+		}
+		else
+		{
+			size_t i = 0;
+			while (i < KEYS && (!_keys[i].created || memcmp(_keys[i].name, name, sizeof(k.name)) != 0)) i++;
+
+			// a key that rotated out. The client does a full handshake.
+			if (i == KEYS) return 0;
+
+			k = _keys[i];
+			newest = i == 0;
+		}
+	}
+
+	OSSL_PARAM params[] =
+	{
+		OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, k.hmac, sizeof(k.hmac)),
+		OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char*>("sha256"), 0),
+		OSSL_PARAM_construct_end()
+	};
+
+	int result;
+	if (enc)
+	{
+		memcpy(name, k.name, sizeof(k.name));
+		result = RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) == 1 &&
+			EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), nullptr, k.aes, iv) == 1 &&
+			EVP_MAC_CTX_set_params(hctx, params) == 1 ? 1 : -1;
+	}
+	else
+	{
+		result = EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), nullptr, k.aes, iv) == 1 &&
+			EVP_MAC_CTX_set_params(hctx, params) == 1 ? (newest ? 1 : 2) : -1;
+	}
+
+	OPENSSL_cleanse(&k, sizeof(k));
+	return result;
+}
+
+
+// SessionCache
+
+SessionCache::SessionCache(size_t capacity)
+	: _per_shard(std::max<size_t>(capacity / SHARDS, 1))
+{
+}
+
+SessionCache::shard &SessionCache::shard_for(const std::string &id)
+{
+	return _shards[std::hash<std::string>()(id) % SHARDS];
+}
+
+void SessionCache::add(SSL_SESSION *session)
+{
+	unsigned int idlen;
+	auto idp = SSL_SESSION_get_id(session, &idlen);
+	std::string id(reinterpret_cast<const char*>(idp), idlen);
+
+	// serialize outside the lock
+	auto len = i2d_SSL_SESSION(session, nullptr);
+	if (len <= 0) return;
+	std::vector<unsigned char> data(static_cast<size_t>(len));
+	auto p = &data[0];
+	i2d_SSL_SESSION(session, &p);
+
+	auto &s = shard_for(id);
+	std::lock_guard<std::mutex> guard(s.lock);
+	auto seq = ++s.seq;
+	s.sessions.insert_or_assign(id, entry{ std::move(data), seq });
+	s.order.emplace_back(std::move(id), seq);
+
+	// drop the oldest. Stale ids are skipped so a session added again isn't dropped early.
+	while (s.sessions.size() > _per_shard || s.order.size() > _per_shard * 2)
+	{
+		auto &oldest = s.order.front();
+		auto found = s.sessions.find(oldest.first);
+		if (found != s.sessions.end() && found->second.seq == oldest.second) s.sessions.erase(found);
+		s.order.pop_front();
+	}
+}
+
+SSL_SESSION *SessionCache::find(const unsigned char *idp, int idlen)
+{
+	std::string id(reinterpret_cast<const char*>(idp), idlen);
+	std::vector<unsigned char> data;
+	{
+		auto &s = shard_for(id);
+		std::lock_guard<std::mutex> guard(s.lock);
+		auto found = s.sessions.find(id);
+		if (found == s.sessions.end()) return nullptr;
+		data = found->second.data;
+	}
+
+	const unsigned char *p = &data[0];
+	auto session = d2i_SSL_SESSION(nullptr, &p, static_cast<long>(data.size()));
+	if (!session) return nullptr;
+
+	if (SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) < time(nullptr))
+	{
+		SSL_SESSION_free(session);
+		remove(idp, idlen);
+		return nullptr;
+	}
+
+	return session;
+}
+
+void SessionCache::remove(const unsigned char *idp, int idlen)
+{
+	std::string id(reinterpret_cast<const char*>(idp), idlen);
+	auto &s = shard_for(id);
+	std::lock_guard<std::mutex> guard(s.lock);
+	s.sessions.erase(id);
+}
+
+
+// EarlyDataFilter
+
+EarlyDataFilter::EarlyDataFilter(uint32_t window, size_t capacity)
+	: _window(window), _per_shard(std::max<size_t>(capacity / SHARDS, 1))
+{
+}
+
+bool EarlyDataFilter::allow(SSL_SESSION *session)
+{
+	auto now = time(nullptr);
+	if (now - SSL_SESSION_get_time(session) > static_cast<time_t>(_window)) return false;
+
+	// tickets are told apart by their resumption secret, which is different for every ticket
+	unsigned char secret[SSL_MAX_MASTER_KEY_LENGTH];
+	auto secretlen = SSL_SESSION_get_master_key(session, secret, sizeof(secret));
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digestlen = 0;
+	auto hashed = EVP_Digest(secret, secretlen, digest, &digestlen, EVP_sha256(), nullptr) == 1;
+	OPENSSL_cleanse(secret, sizeof(secret));
+	if (!hashed) return false;
+
+	std::string id(reinterpret_cast<const char*>(digest), std::min(digestlen, 16u));
+	auto &s = _shards[std::hash<std::string>()(id) % SHARDS];
+	std::lock_guard<std::mutex> guard(s.lock);
+
+	while (!s.order.empty() && s.order.front().first + static_cast<time_t>(_window) < now)
+	{
+		s.seen.erase(s.order.front().second);
+		s.order.pop_front();
+	}
+
+	// seen before, or too many to keep track of. The client sends it again after the handshake.
+	if (s.seen.count(id) || s.seen.size() >= _per_shard) return false;
+
+	s.seen.emplace(id, now);
+	s.order.emplace_back(now, id);
+	return true;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+// the keys session tickets are encrypted with. New tickets use the newest key, which is replaced
+// every rotation interval; tickets of the keys before it are still accepted and get renewed.
+// Thread safe, so one set serves all acceptors and contexts.
+class TicketKeys
+{
+public:
+	static constexpr size_t KEYS = 3;
+
+	TicketKeys(uint32_t rotation = 3600);
+	~TicketKeys();
+	TicketKeys(const TicketKeys&) = delete;
+	TicketKeys& operator=(const TicketKeys&) = delete;
+
+	inline uint32_t rotation() const { return _rotation; }
+	void set_rotation(uint32_t rotation);
+
+	// how long a ticket is at least accepted, in seconds
+	inline uint32_t lifetime() const { return _rotation * (KEYS - 1); }
+
+	// set up encryption of a new ticket or decryption of one from a client, as the openssl ticket
+	// key callback does. Returns 0 for unknown keys, 1 to accept and 2 to accept and renew.
+	int crypt(unsigned char name[16], unsigned char *iv, EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc);
+
+private:
+	struct key
+	{
+		unsigned char name[16];
+		unsigned char aes[32];
+		unsigned char hmac[32];
+		time_t created;
+	};
+
+	void rotate(time_t now);
+
+	std::mutex _lock;
+	// newest first. Keys with created == 0 were never made.
+	key _keys[KEYS];
+	uint32_t _rotation;
+};
+
+// sessions of clients that resume by session id, spread over shards that are locked separately
+// so handshakes on different threads rarely wait for each other. Sessions are kept serialized and
+// the oldest are dropped when a shard is full.
+class SessionCache
+{
+public:
+	static constexpr size_t SHARDS = 16;
+
+	SessionCache(size_t capacity);
+	SessionCache(const SessionCache&) = delete;
+	SessionCache& operator=(const SessionCache&) = delete;
+
+	void add(SSL_SESSION *session);
+	// a new session for the id, or nullptr if there is none or it expired
+	SSL_SESSION *find(const unsigned char *id, int idlen);
+	void remove(const unsigned char *id, int idlen);
+
+private:
+	struct entry
+	{
+		std::vector<unsigned char> data;
+		// matches the order entry that added it
+		uint64_t seq;
+	};
+
+	struct shard
+	{
+		std::mutex lock;
+		std::unordered_map<std::string, entry> sessions;
+		// ids in the order they were added, with the sequence number of that add. Ids that were
+		// removed or added again since are stale and don't match their entry.
+		std::deque<std::pair<std::string, uint64_t>> order;
+		uint64_t seq = 0;
+	};
+
+	shard &shard_for(const std::string &id);
+
+	size_t _per_shard;
+	shard _shards[SHARDS];
+};
+
+// keeps early data from being replayed. Every ticket may carry early data once, and only while it
+// is younger than the window, which is as long as the tickets that did are remembered.
+class EarlyDataFilter
+{
+public:
+	static constexpr size_t SHARDS = 16;
+
+	EarlyDataFilter(uint32_t window, size_t capacity);
+	EarlyDataFilter(const EarlyDataFilter&) = delete;
+	EarlyDataFilter& operator=(const EarlyDataFilter&) = delete;
+
+	inline uint32_t window() const { return _window; }
+
+	// whether the resumed session may carry early data. Remembers it if so.
+	bool allow(SSL_SESSION *session);
+
+private:
+	struct shard
+	{
+		std::mutex lock;
+		std::unordered_map<std::string, time_t> seen;
+		// tickets in the order they were seen, to forget them once the window passed
+		std::deque<std::pair<time_t, std::string>> order;
+	};
+
+	uint32_t _window;
+	size_t _per_shard;
+	shard _shards[SHARDS];
+};
@@ -0,0 +1,231 @@
+#include "pch.hpp"
+#include "Uring.hpp"
+#include <sys/syscall.h>
+
+static int io_uring_setup(unsigned entries, io_uring_params *p)
+{
+	return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+template<typename T>
+static T *ring_field(void *base, unsigned offset)
+{
+	return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+
+
+// Uring
+
+Uring::Uring(unsigned entries)
+	: _entries(entries),
+	_sq_ptr(MAP_FAILED),
+	_cq_ptr(MAP_FAILED),
+	_sqes(static_cast<io_uring_sqe*>(MAP_FAILED))
+{
+	io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_COOP_TASKRUN;
+	_fd = io_uring_setup(entries, &p);
+	if (_fd == -1 && errno == EINVAL)
+	{
+		// older kernels do not know about cooperative task running
+		memset(&p, 0, sizeof(p));
+		_fd = io_uring_setup(entries, &p);
+	}
+	if (_fd == -1) throw system_err();
+
+	if (!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_FAST_POLL))
+	{
+		close(_fd);
+		throw std::runtime_error("io_uring is missing required features");
+	}
+
+	_entries = p.sq_entries;
+	_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (_cq_size > _sq_size) _sq_size = _cq_size;
+		_cq_size = _sq_size;
+	}
+
+	_sq_ptr = mmap(nullptr, _sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+	if (_sq_ptr == MAP_FAILED) { auto e = errno; close(_fd); throw system_err(e); }
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		_cq_ptr = _sq_ptr;
+	}
+	else
+	{
+		_cq_ptr = mmap(nullptr, _cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+		if (_cq_ptr == MAP_FAILED) { auto e = errno; munmap(_sq_ptr, _sq_size); close(_fd); throw system_err(e); }
+	}
+
+	_sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+	_sqes = static_cast<io_uring_sqe*>(mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES));
+	if (_sqes == MAP_FAILED)
+	{
+		auto e = errno;
+		if (_cq_ptr != _sq_ptr) munmap(_cq_ptr, _cq_size);
+		munmap(_sq_ptr, _sq_size);
+		close(_fd);
+		throw system_err(e);
+	}
+
+	_sq_head = ring_field<unsigned>(_sq_ptr, p.sq_off.head);
+	_sq_tail = ring_field<unsigned>(_sq_ptr, p.sq_off.tail);
+	_sqe_tail = *_sq_tail;
+	_sq_mask = *ring_field<unsigned>(_sq_ptr, p.sq_off.ring_mask);
+	_cq_head = ring_field<unsigned>(_cq_ptr, p.cq_off.head);
+	_cq_tail = ring_field<unsigned>(_cq_ptr, p.cq_off.tail);
+	_cq_mask = *ring_field<unsigned>(_cq_ptr, p.cq_off.ring_mask);
+	_cqes = ring_field<io_uring_cqe>(_cq_ptr, p.cq_off.cqes);
+
+	// submission entries are always used in ring order so the index array never changes
+	auto array = ring_field<unsigned>(_sq_ptr, p.sq_off.array);
+	for (unsigned i = 0; i < p.sq_entries; i++) array[i] = i;
+}
+
+Uring::~Uring()
+{
+	if (_sqes != MAP_FAILED) munmap(_sqes, _sqes_size);
+	if (_cq_ptr != MAP_FAILED && _cq_ptr != _sq_ptr) munmap(_cq_ptr, _cq_size);
+	if (_sq_ptr != MAP_FAILED) munmap(_sq_ptr, _sq_size);
+	if (_fd != -1) close(_fd);
+}
+
+bool Uring::supports(uint8_t op) const
+{
+	std::vector<char> buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+	auto probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+	if (io_uring_register(_fd, IORING_REGISTER_PROBE, probe, 256) == -1) return false;
+	return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+}
+
+io_uring_sqe *Uring::get_sqe()
+{
+	if (_sqe_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _entries)
+	{
+		// ring is full. Let the kernel consume what we have so far.
+		submit();
+		if (_sqe_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _entries)
+		{
+			throw std::runtime_error("io_uring submission queue full");
+		}
+	}
+
+	auto sqe = &_sqes[_sqe_tail & _sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	_sqe_tail++;
+	return sqe;
+}
+
+int Uring::submit_and_wait(unsigned wait_nr)
+{
+	// make the entries filled in since the last submit visible to the kernel
+	__atomic_store_n(_sq_tail, _sqe_tail, __ATOMIC_RELEASE);
+
+	for (;;)
+	{
+		unsigned to_submit = _sqe_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+		unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+		int r = io_uring_enter(_fd, to_submit, wait_nr, flags);
+		if (r >= 0)
+		{
+			return r;
+		}
+		else if (errno == EINTR)
+		{
+			continue;
+		}
+		else if (errno == EAGAIN || errno == EBUSY)
+		{
+			// completion queue is backed up. Reap before submitting more.
+			return 0;
+		}
+		else
+		{
+			throw system_err();
+		}
+	}
+}
+
+
+// UringBufferRing
+
+UringBufferRing::UringBufferRing(Uring &ring, uint16_t group, uint16_t count, uint32_t size)
+	: _ring(ring),
+	_group(group),
+	_count(count),
+	_size(size),
+	_tail(0),
+	_buffers(nullptr)
+{
+	// the kernel requires a power of two sized ring
+	if (!count || (count & (count - 1))) throw std::runtime_error("buffer ring size must be a power of two");
+
+	_br_size = static_cast<size_t>(count) * sizeof(io_uring_buf);
+	_br = static_cast<io_uring_buf_ring*>(mmap(nullptr, _br_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0));
+	if (_br == MAP_FAILED) throw system_err();
+
+	_buffers = static_cast<char*>(malloc(static_cast<size_t>(count) * size));
+	if (!_buffers)
+	{
+		munmap(_br, _br_size);
+		throw std::bad_alloc();
+	}
+
+	io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = reinterpret_cast<uint64_t>(_br);
+	reg.ring_entries = count;
+	reg.bgid = group;
+	if (io_uring_register(_ring.fd(), IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+	{
+		auto e = errno;
+		free(_buffers);
+		munmap(_br, _br_size);
+		throw system_err(e);
+	}
+
+	for (uint16_t bid = 0; bid < count; bid++) recycle(bid);
+	publish();
+}
+
+UringBufferRing::~UringBufferRing()
+{
+	io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.bgid = _group;
+	io_uring_register(_ring.fd(), IORING_UNREGISTER_PBUF_RING, &reg, 1);
+
+	free(_buffers);
+	munmap(_br, _br_size);
+}
+
+void UringBufferRing::recycle(uint16_t bid)
+{
+	// the ring is a plain array of io_uring_buf. Not using _br->bufs because the flexible
+	// array wrapper in the kernel header puts it at the wrong offset when compiled as c++
+	auto &buf = reinterpret_cast<io_uring_buf*>(_br)[_tail & (_count - 1)];
+	buf.addr = reinterpret_cast<uint64_t>(buffer(bid));
+	buf.len = _size;
+	buf.bid = bid;
+	_tail++;
+}
+
+void UringBufferRing::publish()
+{
+	__atomic_store_n(&_br->tail, _tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <linux/io_uring.h>
+
+// a minimal io_uring instance: submission and completion rings mapped into our address space.
+// Not thread safe; one ring is owned by one thread.
+class Uring
+{
+public:
+	Uring(unsigned entries);
+	~Uring();
+	Uring(const Uring&) = delete;
+	Uring& operator=(const Uring&) = delete;
+
+	// get a zeroed submission entry. Flushes pending entries to the kernel if the ring is full.
+	io_uring_sqe *get_sqe();
+
+	// submit pending entries and wait until at least wait_nr completions are available
+	int submit_and_wait(unsigned wait_nr);
+	int submit() { return submit_and_wait(0); }
+
+	// process all available completions
+	template<typename F>
+	unsigned for_each_cqe(F f)
+	{
+		unsigned head = *_cq_head;
+		unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+		unsigned count = 0;
+		for (; head != tail; head++, count++)
+		{
+			f(_cqes[head & _cq_mask]);
+		}
+		__atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+		return count;
+	}
+
+	int fd() const { return _fd; }
+
+	// whether the kernel knows the operation. Says nothing about the flags it takes.
+	bool supports(uint8_t op) const;
+
+private:
+	int _fd;
+	unsigned _entries;
+
+	void *_sq_ptr;
+	size_t _sq_size;
+	void *_cq_ptr;
+	size_t _cq_size;
+	io_uring_sqe *_sqes;
+	size_t _sqes_size;
+
+	unsigned *_sq_head;
+	unsigned *_sq_tail;
+	unsigned _sqe_tail;
+	unsigned _sq_mask;
+	unsigned *_cq_head;
+	unsigned *_cq_tail;
+	unsigned _cq_mask;
+	io_uring_cqe *_cqes;
+};
+
+// a ring of fixed size buffers that the kernel picks from when completing
+// recv requests flagged with IOSQE_BUFFER_SELECT for this group.
+class UringBufferRing
+{
+public:
+	UringBufferRing(Uring &ring, uint16_t group, uint16_t count, uint32_t size);
+	~UringBufferRing();
+	UringBufferRing(const UringBufferRing&) = delete;
+	UringBufferRing& operator=(const UringBufferRing&) = delete;
+
+	inline uint16_t group() const { return _group; }
+	inline const char *buffer(uint16_t bid) const { return _buffers + static_cast<size_t>(bid) * _size; }
+
+	// hand a buffer back to the kernel. Only visible after publish()
+	void recycle(uint16_t bid);
+	void publish();
+
+private:
+	Uring &_ring;
+	uint16_t _group;
+	uint16_t _count;
+	uint32_t _size;
+	uint16_t _tail;
+	io_uring_buf_ring *_br;
+	size_t _br_size;
+	char *_buffers;
+};
@@ -0,0 +1,80 @@
+#include "pch.hpp"
+#include "WorkerPool.hpp"
+
+
+WorkerPool::WorkerPool(size_t threads, size_t max_queued)
+	: _max_queued(max_queued), _running(true)
+{
+	for (size_t i = 0; i < threads; i++)
+	{
+		_threads.emplace_back([this]() { worker(); });
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	stop();
+}
+
+bool WorkerPool::submit(std::function<void()> job)
+{
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		if (!_running || _jobs.size() >= _max_queued) return false;
+		_jobs.push_back(std::move(job));
+	}
+
+	_available.notify_one();
+	return true;
+}
+
+void WorkerPool::stop()
+{
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		_running = false;
+	}
+
+	_available.notify_all();
+	for (auto &t : _threads)
+	{
+		if (t.joinable()) t.join();
+	}
+	_threads.clear();
+
+	// jobs may own things that want to be destroyed outside of the lock
+	std::deque<std::function<void()>> dropped;
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		std::swap(dropped, _jobs);
+	}
+}
+
+void WorkerPool::worker()
+{
+	for (;;)
+	{
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> guard(_lock);
+			_available.wait(guard, [this]() { return !_running || !_jobs.empty(); });
+			if (_jobs.empty()) return;
+
+			job = std::move(_jobs.front());
+			_jobs.pop_front();
+		}
+
+		try
+		{
+			job();
+		}
+		catch (std::exception &e)
+		{
+			error("Exception in worker: %s\n", e.what());
+		}
+		catch (...)
+		{
+			error("Unknown exception in worker\n");
+		}
+	}
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+// threads that run jobs handed to them from any thread, for work that would hold up an event loop.
+// Jobs run in the order they were submitted, on whichever thread is free first.
+class WorkerPool
+{
+public:
+	// at most max_queued jobs wait for a thread. Submitting more fails so the caller can do the
+	// work itself instead of waiting longer than that would take.
+	WorkerPool(size_t threads, size_t max_queued = 1024);
+	~WorkerPool();
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+
+	inline size_t size() const { return _threads.size(); }
+
+	// queue a job. Returns false if too many are waiting already.
+	bool submit(std::function<void()> job);
+
+	// run the jobs queued so far and stop the threads. Submitting fails from here on.
+	void stop();
+
+private:
+	void worker();
+
+	std::mutex _lock;
+	std::condition_variable _available;
+	std::deque<std::function<void()>> _jobs;
+	size_t _max_queued;
+	bool _running;
+	std::vector<std::thread> _threads;
+};
@@ -99,6 +99,13 @@ bool endswith(const char* a, size_t asize, const char *b, size_t bsize) noexcept
 	return strncasecmp(a + (asize - bsize), b, bsize) == 0;
 }
 
+uint64_t coarse_clock() noexcept
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
 static const char _fat[] = "\x1B[1;31m[fatal] ";
 static const char _err[] = "\x1B[0;31m[error] ";
 static const char _wrn[] = "\x1B[0;33m[warng] ";
@@ -134,8 +141,8 @@ void log(LogLevel ll, const char *format, ...)
 	}
 
 	time_t secs;
-	auto t = localtime(&secs);
 	time(&secs);
+	auto t = localtime(&secs);
 	fprintf(fp, "[%4d-%2d-%2d %2d:%2d:%2d]%s", t->tm_year, t->tm_mon, t->tm_mday, t->tm_hour, t->tm_min, t->tm_sec, _pfx);
 
 	va_list args;
@@ -45,28 +45,124 @@ int main(int argc, char *argv[])
 	{
 		maximize_fds();
 
-		std::shared_ptr<Hosting> static_hosting = std::make_shared<StaticHosting>("./rabbiteer.io");
+		// SIGHUP is taken by the reload thread below. Blocked before any threads start so that
+		// they all inherit it.
+		sigset_t hup;
+		sigemptyset(&hup);
+		sigaddset(&hup, SIGHUP);
+		pthread_sigmask(SIG_BLOCK, &hup, nullptr);
+
+		// pick the event engine. io_uring copies whatever it sends and has no sendfile.
+		EventEngine engine = EventEngine::Epoll;
+		bool ktls = false;
+		size_t session_cache = 0;
+		uint32_t early_data = 0;
+		bool handshake_pool = false;
+		const char *groups = nullptr;
+		bool ocsp = false;
+		size_t cache_mb = 0;
+		size_t cache_files = 0;
+		// by default every acceptor accepts for itself on a reuseport socket, and the kernel
+		// steers connections to the one on their cpu. --dispatch has one thread accept and pick
+		// acceptors by their load instead.
+		ListenMode mode = ListenMode::ReusePort;
+		DispatchPolicy dispatch = DispatchPolicy::PowerOfTwo;
+		// connection timeouts are given in seconds. 0 turns one off.
+		Timeouts timeouts;
+		for (int i = 1; i < argc; i++)
+		{
+			if (strcmp(argv[i], "--io-uring") == 0) engine = EventEngine::IoUring;
+			else if (strcmp(argv[i], "--ktls") == 0) ktls = true;
+			else if (strcmp(argv[i], "--session-cache") == 0) session_cache = 20480;
+			else if (strcmp(argv[i], "--early-data") == 0) early_data = 16384;
+			else if (strcmp(argv[i], "--handshake-pool") == 0) handshake_pool = true;
+			else if (strcmp(argv[i], "--groups") == 0 && i + 1 < argc) groups = argv[++i];
+			else if (strcmp(argv[i], "--ocsp") == 0) ocsp = true;
+			else if (strcmp(argv[i], "--cache-mb") == 0 && i + 1 < argc) cache_mb = strtoul(argv[++i], nullptr, 10);
+			else if (strcmp(argv[i], "--cache-files") == 0 && i + 1 < argc) cache_files = strtoul(argv[++i], nullptr, 10);
+			else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc) timeouts.idle = strtoul(argv[++i], nullptr, 10) * 1000;
+			else if (strcmp(argv[i], "--header-timeout") == 0 && i + 1 < argc) timeouts.header = strtoul(argv[++i], nullptr, 10) * 1000;
+			else if (strcmp(argv[i], "--write-timeout") == 0 && i + 1 < argc) timeouts.write = strtoul(argv[++i], nullptr, 10) * 1000;
+			else if (strcmp(argv[i], "--dispatch") == 0 && i + 1 < argc)
+			{
+				mode = ListenMode::Single;
+				auto policy = argv[++i];
+				if (strcmp(policy, "round-robin") == 0) dispatch = DispatchPolicy::RoundRobin;
+				else if (strcmp(policy, "power-of-two") == 0) dispatch = DispatchPolicy::PowerOfTwo;
+				else if (strcmp(policy, "least-loaded") == 0) dispatch = DispatchPolicy::LeastLoaded;
+				else throw std::runtime_error("--dispatch is one of round-robin, power-of-two or least-loaded");
+			}
+		}
+
+		auto static_hosting = std::make_shared<StaticHosting>("./rabbiteer.io");
+		// files that weren't requested for a minute may leave memory
+		static_hosting->cache().set_budget(cache_mb * 1024 * 1024, cache_files);
+		static_hosting->cache().set_cold(60);
 		Tls tls;
 		HttpServer http{ static_hosting };
 
-		tls.add_certificate("localhost.cer", "localhost.key");
-		tls.add_certificate("localtest.cer", "localtest.key");
+		// hosts have an ecdsa certificate, and an rsa one next to it for older clients if there is one
+		auto add_host = [&tls](const std::string &name)
+		{
+			std::vector<std::pair<std::string, std::string>> files{ { name + ".cer", name + ".key" } };
+			if (access((name + ".rsa.cer").c_str(), R_OK) == 0) files.emplace_back(name + ".rsa.cer", name + ".rsa.key");
+			tls.add_certificate(files);
+		};
+		add_host("localhost");
+		add_host("localtest");
+		if (groups) tls.set_groups(groups);
+		if (ocsp) tls.set_ocsp_stapling(3600);
+		tls.set_ktls(ktls);
+		tls.set_session_cache(session_cache);
+		tls.set_early_data(early_data);
 
 		tls.add_handler([&http](std::shared_ptr<TlsSocket> sock) { return std::make_shared<HttpHandler>(http, sock); });
 		tls.add_handler("http/1.1", [&http](std::shared_ptr<TlsSocket> sock) { return std::make_shared<HttpHandler>(http, sock); });
 		tls.add_handler("h2", [&http](std::shared_ptr<TlsSocket> sock) { return std::make_shared<Http2Handler>(http, sock); });
 
-		Listener l1(nullptr, 8443, [&tls,&http](std::shared_ptr<Socket> socket, std::shared_ptr<SocketEventProducer> events)
+		// handshakes go to threads of their own so they don't hold up established connections.
+		// Declared before the acceptors so it is destroyed after them, and stopped below while they
+		// still run.
+		std::unique_ptr<WorkerPool> handshakes;
+		if (handshake_pool)
+		{
+			handshakes.reset(new WorkerPool(std::max(1u, std::thread::hardware_concurrency() / 2)));
+			tls.set_handshake_pool(handshakes.get());
+		}
+
+		// one set of event loop threads serves both ports
+		AcceptorPool pool(engine, timeouts);
+
+		Listener l1(pool, nullptr, 8443, [&tls,&http](std::shared_ptr<Socket> socket, std::shared_ptr<SocketEventProducer> events)
 		{
 			auto tls_socket = std::make_shared<TlsSocket>(socket, tls);
 			events->connect(tls_socket);
 			tls_socket->set_shared_ptr(tls_socket);
-		});
+		}, mode, dispatch);
 
-		Listener l2(nullptr, 8080, [&tls, &http](std::shared_ptr<Socket> socket, std::shared_ptr<SocketEventProducer> events)
+		Listener l2(pool, nullptr, 8080, [&tls, &http](std::shared_ptr<Socket> socket, std::shared_ptr<SocketEventProducer> events)
 		{
 			auto handler = std::make_shared<HttpHandler>(http, socket);
 			events->connect(handler);
+		}, mode, dispatch);
+
+		// kill -HUP loads the certificates again, for example after they were renewed
+		std::atomic<bool> running{ true };
+		std::thread reloader([&tls, &running, hup]()
+		{
+			int sig;
+			while (sigwait(&hup, &sig) == 0 && running)
+			{
+				try
+				{
+					tls.reload_certificates();
+					info("reloaded certificates\n");
+				}
+				catch (std::runtime_error &e)
+				{
+					error("could not reload certificates: %s\n", e.what());
+				}
+			}
 		});
 
 		listeners.push_back(&l1);
@@ -76,6 +172,20 @@ int main(int argc, char *argv[])
 		l2.wait();
 		listeners.clear();
 
+		// finish the handshakes that were handed off. Hellos after this are answered on the event loops.
+		if (handshakes) handshakes->stop();
+
+		running = false;
+		pthread_kill(reloader.native_handle(), SIGHUP);
+		reloader.join();
+
+		info("%llu tls handshakes, %llu resumed\n",
+			static_cast<unsigned long long>(tls.handshakes()),
+			static_cast<unsigned long long>(tls.resumptions()));
+
+		auto cached = static_hosting->cache().usage();
+		info("%zu files cached, %zu KB mapped, %zu KB resident\n", cached.files, cached.bytes / 1024, cached.resident / 1024);
+
 		return 0;
 	}
 	catch(std::runtime_error &e)
@@ -9,6 +9,10 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <errno.h>
 #include <signal.h>
 #include <sys/mman.h>
@@ -22,6 +26,8 @@
 #include <openssl/evp.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
+#include <openssl/rand.h>
+#include <openssl/core_names.h>
 #include <openssl/bio.h>
 #include <openssl/crypto.h>
 #include <openssl/x509.h>
@@ -29,6 +35,7 @@
 #include <openssl/objects.h>
 #include <openssl/ts.h>
 #include <openssl/pkcs7.h>
+#include <openssl/ocsp.h>
 
 #include <nghttp2/nghttp2.h>
 
@@ -36,10 +43,17 @@
 #include <thread>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <functional>
 #include <queue>
+#include <deque>
 #include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
+#include <future>
 
 class system_err : public std::runtime_error
 {
@@ -62,6 +76,8 @@ std::string pathextension(const std::string &path) noexcept;
 int case_insensitive_compare(const char *a, size_t asize, const char *b, size_t bsize) noexcept;
 bool startswith(const char* a, size_t asize, const char *b, size_t bsize) noexcept;
 bool endswith(const char* a, size_t asize, const char *b, size_t bsize) noexcept;
+// a cheap monotonic clock in milliseconds, good to a few ms
+uint64_t coarse_clock() noexcept;
 
 inline int case_insensitive_compare(const std::string &a, const std::string &b) noexcept
 {
@@ -0,0 +1,94 @@
+// checks the budget of the file cache: a large file takes its share of the budget without pushing
+// out the files that happen to land in the same shard, and one larger than the whole budget is
+// served without being kept. Also that files changed on disk are mapped again.
+//
+//   make test
+
+#include "../server/pch.hpp"
+#include "../server/FileCache.hpp"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+	printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+	if (!ok) failures++;
+}
+
+static std::string write_file(const std::string &dir, const std::string &name, size_t size)
+{
+	auto path = dir + "/" + name;
+	std::string content(size, static_cast<char>('a' + name.size() % 26));
+	auto f = fopen(path.c_str(), "wb");
+	if (!f || fwrite(content.data(), 1, content.size(), f) != content.size()) throw system_err();
+	fclose(f);
+	return path;
+}
+
+int main()
+{
+	char dir[] = "/tmp/filecache.XXXXXX";
+	if (!mkdtemp(dir)) throw system_err();
+
+	const size_t KB = 1024;
+	const size_t budget = 2048 * KB;
+
+	// sixty four small files spread over every shard, half the budget in all
+	std::vector<std::string> small;
+	for (int i = 0; i < 64; i++) small.push_back(write_file(dir, "small" + std::to_string(i), 16 * KB));
+	// bigger than budget / SHARDS, smaller than what is left of the budget
+	auto large = write_file(dir, "large", 768 * KB);
+	// bigger than the whole budget
+	auto huge = write_file(dir, "huge", 3072 * KB);
+
+	FileCache cache;
+	cache.set_budget(budget, 0);
+
+	for (auto &name : small) cache.get(name);
+	auto before = cache.usage();
+	check(before.files == small.size() && before.bytes == small.size() * 16 * KB, "small files are all kept");
+
+	auto f = cache.get(large);
+	auto after = cache.usage();
+	check(f && f->size() == 768 * KB, "large file is mapped");
+	check(after.files == small.size() + 1, "large file does not push out files of its shard");
+	check(after.bytes == before.bytes + 768 * KB, "large file counts against the budget");
+
+	auto h = cache.get(huge);
+	check(h && h->size() == 3072 * KB && h->data()[0] == 'e', "file over the budget is still served");
+	check(cache.usage().bytes == after.bytes && cache.usage().files == after.files, "file over the budget is not kept");
+
+	// another large file has to evict, and the cache stays within budget
+	auto more = write_file(dir, "another", 768 * KB);
+	cache.get(more);
+	check(cache.usage().bytes <= budget, "cache stays within the budget");
+
+	try
+	{
+		cache.get(std::string(dir) + "/missing");
+		check(false, "missing file throws");
+	}
+	catch (std::runtime_error &)
+	{
+		check(cache.usage().files <= after.files + 1, "missing file is not kept");
+	}
+
+	// a file written to while cached is mapped again, at most a second later
+	auto changing = write_file(dir, "changing", 4 * KB);
+	auto first = cache.get(changing);
+	write_file(dir, "changing", 8 * KB);
+	usleep(1100 * 1000);
+	auto second = cache.get(changing);
+	check(first->size() == 4 * KB && second->size() == 8 * KB, "changed file is mapped again");
+	check(cache.get(changing) == second, "changed file is cached again");
+	unlink(changing.c_str());
+
+	for (auto &name : small) unlink(name.c_str());
+	unlink(large.c_str());
+	unlink(huge.c_str());
+	unlink(more.c_str());
+	rmdir(dir);
+
+	printf("%d failures\n", failures);
+	return failures ? 1 : 0;
+}